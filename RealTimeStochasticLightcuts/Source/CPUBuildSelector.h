@@ -0,0 +1,113 @@
+// Copyright (c) 2020, Daqi Lin <daqi@cs.utah.edu>
+// All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+#include <chrono>
+#include <cmath>
+#include "CPULightCuts.h"
+
+#define LIGHTCUTS_SELECTOR_AVERAGE_WEIGHT 0.2f	// weight of the newest build in the running averages of the build selector
+#define LIGHTCUTS_SELECTOR_COST_PERIOD 16		// the build selector measures the tree cost of every this many builds of a mode
+
+// Picks the build mode of a light tree at runtime from the number of lights and a time budget.
+// Each mode keeps running averages of its build time per n log n lights and of the cost of its trees (TreeCost, lower is better).
+// Select returns the mode with the lowest cost among the ones expected to fit the budget, or the fastest one if none fits.
+// The tree cost is measured on the lights that are actually built, so it also accounts for their spatial spread,
+// e.g. the Morton-ordered builder loses quality on unevenly spread lights. A mode that has not been measured yet
+// starts from conservative single-thread timings and is tried as soon as it fits the budget.
+class LightTreeBuildSelector
+{
+public:
+
+	typedef LightCutsBase::BuildMode BuildMode;
+	static const int numModes = 4;
+
+	BuildMode Select(int numLights, float budgetMs) const
+	{
+		float work = Work(numLights);
+		int best = -1;
+		int fastest = 0;
+		for (int mode = 0; mode < numModes; mode++) {
+			float predictedMs = modeStats[mode].msPerWork * work;
+			if (predictedMs < modeStats[fastest].msPerWork * work) fastest = mode;
+			if (predictedMs > budgetMs) continue;
+			if (modeStats[mode].costSamples == 0) return (BuildMode)mode;
+			if (best < 0 || modeStats[mode].cost < modeStats[best].cost) best = mode;
+		}
+		return (BuildMode)(best >= 0 ? best : fastest);
+	}
+
+	// Returns the given mode, or the selected one if it is numModes, as in the adaptive entry of the build mode menu
+	BuildMode Select(int forcedMode, int numLights, float budgetMs) const
+	{
+		return forcedMode < numModes ? (BuildMode)forcedMode : Select(numLights, budgetMs);
+	}
+
+	// Runs build, which builds the tree with its current build mode, and records its time and, periodically, the tree cost
+	template <typename Tree, typename BuildFunc>
+	void Measure(Tree &tree, int numLights, BuildFunc build)
+	{
+		auto start = std::chrono::high_resolution_clock::now();
+		build();
+		float ms = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+
+		ModeStats &stats = modeStats[(int)tree.GetBuildMode()];
+		float msPerWork = ms / Work(numLights);
+		stats.msPerWork = stats.builds == 0 ? msPerWork : Average(stats.msPerWork, msPerWork);
+		if (stats.builds % LIGHTCUTS_SELECTOR_COST_PERIOD == 0) {
+			float cost = tree.GetTreeCost();
+			stats.cost = stats.costSamples == 0 ? cost : Average(stats.cost, cost);
+			stats.costSamples++;
+		}
+		stats.builds++;
+	}
+
+	float GetPredictedTime(BuildMode mode, int numLights) const { return modeStats[(int)mode].msPerWork * Work(numLights); }
+	float GetAverageCost(BuildMode mode) const { return modeStats[(int)mode].cost; }
+
+	// Names for the profiler, which reports the time of each mode under its own name
+	static const wchar_t *ModeName(BuildMode mode)
+	{
+		static const wchar_t *names[numModes] = { L"Heap Build", L"Locally Ordered Build", L"Top-Down SAOH Build", L"NN Chain Build" };
+		return names[(int)mode];
+	}
+
+private:
+
+	struct ModeStats
+	{
+		float msPerWork;
+		float cost;
+		int   builds;
+		int   costSamples;
+	};
+
+	// single-thread timings of 20k lights, replaced by the first build of each mode
+	ModeStats modeStats[numModes] = {
+		{ 3.5e-4f, 0, 0, 0 },	// HEAP
+		{ 1.6e-4f, 0, 0, 0 },	// LOCALLY_ORDERED
+		{ 2.3e-4f, 0, 0, 0 },	// TOP_DOWN_SAOH
+		{ 3.4e-4f, 0, 0, 0 }	// NN_CHAIN
+	};
+
+	static float Work(int numLights) { return numLights * log2f((float)std::max(numLights, 2)); }
+	static float Average(float average, float value) { return average + LIGHTCUTS_SELECTOR_AVERAGE_WEIGHT * (value - average); }
+};
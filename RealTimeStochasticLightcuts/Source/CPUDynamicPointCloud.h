@@ -0,0 +1,199 @@
+// Copyright (c) 2020, Daqi Lin <daqi@cs.utah.edu>
+// All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <cfloat>
+#include <ppl.h>
+#include <glm/glm.hpp>
+
+// A k-d tree of 3D points that supports removing points.
+// Every k-d tree node keeps the number of live points in its subtree, so searches skip the branches
+// whose points have all been removed and the tree never needs to be rebuilt.
+// The tree is stored implicitly as a complete binary tree: the children of node k are 2k and 2k+1.
+// liveCounts[k] stores twice the live point count of the subtree plus one if the point of node k itself is live.
+class DynamicPointCloud
+{
+public:
+
+	template <typename PointPosFunc>
+	void Build(int numPts, PointPosFunc ptPosFunc)
+	{
+		pointCount = numPts;
+		liveCount = numPts;
+		points.resize(numPts + 1);
+		liveCounts.resize(numPts + 1);
+		slots.resize(numPts);
+		if (numPts == 0) return;
+
+		std::vector<PointData> &orig = buildPoints;
+		orig.resize(numPts);
+		glm::vec3 boundMin(FLT_MAX), boundMax(-FLT_MAX);
+		for (int i = 0; i < numPts; i++) {
+			glm::vec3 p = ptPosFunc(i);
+			orig[i].pos = p;
+			orig[i].indexAxis = i;	// the axis is packed in by BuildKDTree
+			boundMin = glm::min(boundMin, p);
+			boundMax = glm::max(boundMax, p);
+		}
+		BuildKDTree(orig.data(), boundMin, boundMax, 1, 0, numPts);
+	}
+
+	// Removes the point with the given index from all future searches
+	void Remove(int index)
+	{
+		int k = slots[index];
+		if ((liveCounts[k] & 1) == 0) return;
+		liveCounts[k] -= 1;
+		for (; k >= 1; k >>= 1) liveCounts[k] -= 2;
+		liveCount--;
+	}
+
+	bool IsLive(int index) const { return (liveCounts[slots[index]] & 1) != 0; }
+	int  GetLiveCount() const { return liveCount; }
+	int  GetPointCount() const { return pointCount; }
+
+	// Finds the closest live point to the given position, ignoring the point with the index excludeIndex.
+	// Points further than sqrt(maxDistanceSquared) are not considered. Among equally close points the one
+	// with the lowest index is returned, so the result does not depend on the search bound.
+	// Returns true if a point is found.
+	bool GetClosest(const glm::vec3 &position, int excludeIndex, int &closestIndex, float &closestDistanceSquared, float maxDistanceSquared = FLT_MAX) const
+	{
+		closestIndex = -1;
+		closestDistanceSquared = maxDistanceSquared;
+		ForEachWithin(position, excludeIndex, closestDistanceSquared, [&](int index, float d2)
+		{
+			if (d2 < closestDistanceSquared || closestIndex < 0 || index < closestIndex) {
+				closestIndex = index;
+				closestDistanceSquared = d2;
+			}
+		});
+		return closestIndex >= 0;
+	}
+
+	// Calls visitor(index, distanceSquared) for the live points within sqrt(maxDistanceSquared) of the given position,
+	// ignoring the point with the index excludeIndex. The nearer branches are visited first, and the visitor
+	// may lower maxDistanceSquared to skip the points that are further.
+	template <typename Visitor>
+	void ForEachWithin(const glm::vec3 &position, int excludeIndex, float &maxDistanceSquared, Visitor visitor) const
+	{
+		if (pointCount == 0) return;
+
+		struct StackEntry
+		{
+			int   nodeID;
+			float planeDist2;	// squared distance to the splitting plane that separates this subtree from the search position
+		};
+		StackEntry stack[64];
+		int stackPos = 0;
+		stack[stackPos++] = { 1, 0.f };
+
+		while (stackPos > 0) {
+			StackEntry entry = stack[--stackPos];
+			int k = entry.nodeID;
+			if (entry.planeDist2 > maxDistanceSquared) continue;
+			int live = liveCounts[k];
+			if (live == 0) continue;
+			const PointData &p = points[k];
+			int index = p.indexAxis >> 2;
+
+			// check the node point
+			if ((live & 1) && index != excludeIndex) {
+				glm::vec3 d = p.pos - position;
+				float d2 = glm::dot(d, d);
+				if (d2 <= maxDistanceSquared) visitor(index, d2);
+			}
+
+			// traverse the far child after the near child
+			int child = 2 * k;
+			if (child > pointCount) continue;
+			int axis = p.indexAxis & 3;
+			float dist1 = position[axis] - p.pos[axis];
+			int nearChild = dist1 < 0 ? child : child + 1;
+			int farChild = dist1 < 0 ? child + 1 : child;
+			if (farChild <= pointCount) stack[stackPos++] = { farChild, std::max(entry.planeDist2, dist1 * dist1) };
+			if (nearChild <= pointCount) stack[stackPos++] = { nearChild, entry.planeDist2 };
+		}
+	}
+
+private:
+
+	struct PointData
+	{
+		glm::vec3 pos;
+		int indexAxis;	// the point index in the upper bits and the splitting axis in the lowest 2 bits
+	};
+
+	std::vector<PointData> points;	// the k-d tree, starting from index 1
+	std::vector<int> liveCounts;
+	std::vector<int> slots;			// the k-d tree node of each point index
+	std::vector<PointData> buildPoints;	// scratch of Build, kept so that rebuilds do not allocate
+	int pointCount = 0;
+	int liveCount = 0;
+
+	int BuildKDTree(PointData *orig, glm::vec3 boundMin, glm::vec3 boundMax, int kdIndex, int ixStart, int ixEnd)
+	{
+		int n = ixEnd - ixStart;
+		if (n <= 0) return 0;
+		int axis = 0;
+		glm::vec3 d = boundMax - boundMin;
+		if (d.y > d[axis]) axis = 1;
+		if (d.z > d[axis]) axis = 2;
+
+		int ixMid = ixStart + LeftSize(n);
+		std::nth_element(orig + ixStart, orig + ixMid, orig + ixEnd, [axis](const PointData &a, const PointData &b) { return a.pos[axis] < b.pos[axis]; });
+		PointData &p = points[kdIndex];
+		p.pos = orig[ixMid].pos;
+		p.indexAxis = (orig[ixMid].indexAxis << 2) | axis;
+		slots[orig[ixMid].indexAxis] = kdIndex;
+
+		glm::vec3 bMax = boundMax;
+		bMax[axis] = p.pos[axis];
+		glm::vec3 bMin = boundMin;
+		bMin[axis] = p.pos[axis];
+		int leftCount = 0, rightCount = 0;
+		const int parallelInvokeThreshold = 256;
+		if (ixMid - ixStart > parallelInvokeThreshold && ixEnd - ixMid + 1 > parallelInvokeThreshold) {
+			concurrency::parallel_invoke(
+				[&] { leftCount = BuildKDTree(orig, boundMin, bMax, kdIndex * 2, ixStart, ixMid); },
+				[&] { rightCount = BuildKDTree(orig, bMin, boundMax, kdIndex * 2 + 1, ixMid + 1, ixEnd); }
+			);
+		}
+		else {
+			leftCount = BuildKDTree(orig, boundMin, bMax, kdIndex * 2, ixStart, ixMid);
+			rightCount = BuildKDTree(orig, bMin, boundMax, kdIndex * 2 + 1, ixMid + 1, ixEnd);
+		}
+		int count = leftCount + rightCount + 1;
+		liveCounts[kdIndex] = count * 2 + 1;
+		return count;
+	}
+
+	// Returns the number of points in the left subtree of a complete binary tree with n points
+	static int LeftSize(int n)
+	{
+		int f = n; // size of the full tree
+		for (int s = 1; s < 32; s *= 2) f |= f >> s;
+		int l = f >> 1; // size of the full left child
+		int r = l >> 1; // size of the full right child without leaf nodes
+		return (l + r + 1 <= n) ? l : n - r - 1;
+	}
+};
@@ -0,0 +1,247 @@
+// Copyright (c) 2020, Daqi Lin <daqi@cs.utah.edu>
+// All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+#include <vector>
+#include <string>
+#include <fstream>
+#include <cstdio>
+#include <climits>
+#include "CPULightTreeFile.h"
+
+#define LIGHTCUTS_EXTERNAL_MORTON_BITS 6		// bits per axis of the Morton cells that the out-of-core builder groups into buckets
+#define LIGHTCUTS_EXTERNAL_BLOCK_LIGHTS 4096	// lights per block of the bucket file; each bucket buffers one block in memory
+
+// Builds a light tree over more lights than fit in memory, writing the nodes to a file.
+// The lights are partitioned along a Morton curve into buckets of at most maxLightsInMemory lights,
+// which are spilled to a temporary file. Each bucket is then loaded and built in memory by LightCuts,
+// and the bucket roots are merged by a top tree. Peak memory is the tree of one bucket plus one block
+// of lights per bucket.
+// The node file is a one-level light tree file of CPULightTreeFile.h, with the array that LightCuts::ExportGPUNodes
+// would write for the whole tree: 2 * numLights Nodes, node 0 unused and the root at 1, internal nodes pointing
+// at their primary child, which the secondary child follows, and leaves at 2 * numLights + light index.
+// The top tree comes first and the nodes of each bucket are contiguous. With a single bucket the file is its tree.
+// The light functors are called in three passes over the lights, one light at a time, so they can stream
+// the lights from disk. numLights is limited by the leaf IDs of the Node layout to INT_MAX / 3.
+class ExternalLightTreeBuilder
+{
+public:
+
+	void SetLightType(LightCuts::LightType lightType) { this->lightType = lightType; }
+	void SetBuildMode(LightCuts::BuildMode buildMode) { this->buildMode = buildMode; }
+	void SetMaxLightsInMemory(int maxLights) { maxLightsInMemory = std::max(maxLights, 1); }
+
+	int   GetNumBuckets() const { return (int)bucketSizes.size(); }
+	float GetGlobalBoundDiag() const { return globalBoundDiag; }
+
+	// Builds the tree into nodeFile, using spillFile for the buckets and deleting it afterwards, also when the build fails.
+	// contentHash goes to the header of the node file. Returns false if numLights is out of range or a file cannot be written or read.
+	template <typename LightColorFunc, typename LightPosFunc, typename LightConeFunc, typename BoundingBoxFunc>
+	bool Build(int numLights, LightColorFunc lightColorFunc, LightPosFunc lightPosFunc, LightConeFunc lightConeFunc, BoundingBoxFunc boundingBoxFunc,
+		uint32_t seed, const std::string &nodeFile, const std::string &spillFile, uint64_t contentHash = 0)
+	{
+		if (numLights <= 0 || numLights > INT_MAX / 3) return false;
+		std::fstream spill;
+		auto removeSpill = [&]()
+		{
+			spill.close();
+			std::remove(spillFile.c_str());
+			return false;
+		};
+
+		// first pass: the bounds of the Morton grid
+		aabb centerBound;
+		for (int i = 0; i < numLights; i++) centerBound.Union(lightPosFunc(i));
+		glm::vec3 centerExtent = centerBound.dimension();
+		for (int j = 0; j < 3; j++) if (centerExtent[j] <= 0) centerExtent[j] = 1;
+		auto mortonCell = [&](const glm::vec3 &pos)
+		{
+			const unsigned quantLevel = 1 << LIGHTCUTS_EXTERNAL_MORTON_BITS;
+			glm::vec3 normPos = (pos - centerBound.pos) / centerExtent;
+			unsigned quantX = BitExpansion(std::min(unsigned(std::max(0.f, normPos.x) * quantLevel), quantLevel - 1));
+			unsigned quantY = BitExpansion(std::min(unsigned(std::max(0.f, normPos.y) * quantLevel), quantLevel - 1));
+			unsigned quantZ = BitExpansion(std::min(unsigned(std::max(0.f, normPos.z) * quantLevel), quantLevel - 1));
+			return quantX * 4 + quantY * 2 + quantZ;
+		};
+
+		// second pass: count the lights of each cell, and group consecutive cells into buckets.
+		// A cell with more than maxLightsInMemory lights is split into several buckets in the order of the lights.
+		const int numCells = 1 << (3 * LIGHTCUTS_EXTERNAL_MORTON_BITS);
+		cellCounts.assign(numCells, 0);
+		for (int i = 0; i < numLights; i++) cellCounts[mortonCell(lightPosFunc(i))]++;
+		cellBuckets.resize(numCells);
+		bucketSizes.clear();
+		for (int c = 0; c < numCells; c++) {
+			int count = cellCounts[c];
+			if (bucketSizes.empty() || (count > 0 && bucketSizes.back() > 0 && bucketSizes.back() + count > maxLightsInMemory)) bucketSizes.push_back(0);
+			cellBuckets[c] = (int)bucketSizes.size() - 1;
+			for (; count > maxLightsInMemory; count -= maxLightsInMemory) {
+				bucketSizes.back() = maxLightsInMemory;
+				bucketSizes.push_back(0);
+			}
+			bucketSizes.back() += count;
+		}
+		int numBuckets = (int)bucketSizes.size();
+
+		// third pass: spill the lights to their buckets, one block at a time
+		spill.open(spillFile, std::ios_base::in | std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+		if (!spill) return removeSpill();
+		const std::streamoff blockBytes = LIGHTCUTS_EXTERNAL_BLOCK_LIGHTS * sizeof(BucketLight);
+		int numBlocks = 0;
+		bucketBlocks.assign(numBuckets, std::vector<int>());
+		bucketBuffers.resize(numBuckets);
+		for (auto &buffer : bucketBuffers) {
+			buffer.clear();
+			buffer.reserve(LIGHTCUTS_EXTERNAL_BLOCK_LIGHTS);
+		}
+		auto flush = [&](int b)
+		{
+			spill.seekp(numBlocks * blockBytes);
+			spill.write((const char*)bucketBuffers[b].data(), bucketBuffers[b].size() * sizeof(BucketLight));
+			bucketBlocks[b].push_back(numBlocks++);
+			bucketBuffers[b].clear();
+		};
+		std::fill(cellCounts.begin(), cellCounts.end(), 0); // now the lights of each cell spilled so far
+		for (int i = 0; i < numLights; i++) {
+			BucketLight light;
+			light.pos = lightPosFunc(i);
+			light.color = lightColorFunc(i);
+			light.cone = lightConeFunc(i);
+			aabb bound = lightType == LightCuts::LightType::POINT ? aabb(light.pos) : boundingBoxFunc(i);
+			light.boundMin = bound.pos;
+			light.boundMax = bound.end;
+			light.lightID = i;
+			int c = mortonCell(light.pos);
+			int b = cellBuckets[c] + cellCounts[c]++ / maxLightsInMemory;
+			bucketBuffers[b].push_back(light);
+			if (bucketBuffers[b].size() == LIGHTCUTS_EXTERNAL_BLOCK_LIGHTS) flush(b);
+		}
+		for (int b = 0; b < numBuckets; b++) if (!bucketBuffers[b].empty()) flush(b);
+		if (!spill) return removeSpill();
+
+		// build the buckets, writing all of their nodes but the roots after the top tree
+		std::ofstream out(nodeFile, std::ios_base::binary);
+		if (!out) return removeSpill();
+		const int numNodes = 2 * numLights;
+		LightTreeFileHeader fileHeader = MakeLightTreeFileHeader(numNodes, 0, 0, 0.f, contentHash);
+		topNodes.assign(2 * numBuckets, ::Node());
+		out.write((const char*)&fileHeader, sizeof(fileHeader));
+		out.seekp(fileHeader.nodeOffset);
+		out.write((const char*)topNodes.data(), topNodes.size() * sizeof(::Node));
+		int nodeOffset = 2 * numBuckets; // where the nodes of the next bucket go
+		tree.SetWorkspace(&workspace);
+		tree.SetLightType(lightType);
+		tree.SetBuildMode(buildMode);
+		roots.resize(numBuckets);
+		for (int b = 0; b < numBuckets; b++) {
+			int n = bucketSizes[b];
+			lights.resize(n);
+			for (int k = 0; k < (int)bucketBlocks[b].size(); k++) {
+				int first = k * LIGHTCUTS_EXTERNAL_BLOCK_LIGHTS;
+				spill.seekg(bucketBlocks[b][k] * blockBytes);
+				spill.read((char*)&lights[first], std::min(n - first, LIGHTCUTS_EXTERNAL_BLOCK_LIGHTS) * sizeof(BucketLight));
+			}
+			if (!spill) return removeSpill();
+
+			tree.Build(n, [&](int i) {return CPUColor(lights[i].color); },
+				[&](int i) {return lights[i].pos; },
+				[&](int i) {return lights[i].cone; },
+				[&](int i) {return aabb(lights[i].boundMin, lights[i].boundMax); }, seed + 1 + b);
+			bucketNodes.resize(2 * n);
+			tree.ExportGPUNodes(bucketNodes.data(), [&](int lightID) { return numNodes + lights[lightID].lightID; });
+
+			if (numBuckets == 1) {
+				// the tree of the only bucket is the whole tree, with the same node IDs
+				out.seekp(fileHeader.nodeOffset);
+				out.write((const char*)bucketNodes.data(), bucketNodes.size() * sizeof(::Node));
+				globalBoundDiag = tree.globalBoundDiag;
+				break;
+			}
+
+			// node 2 of the bucket goes to nodeOffset
+			for (int j = 1; j < 2 * n; j++) if (bucketNodes[j].ID < 2 * n) bucketNodes[j].ID += nodeOffset - 2;
+			out.write((const char*)(bucketNodes.data() + 2), (2 * n - 2) * sizeof(::Node));
+			nodeOffset += 2 * n - 2;
+
+			LightCuts::Node root = tree.GetNode(0);
+			roots[b].node = bucketNodes[1];
+			roots[b].color = root.color;
+			roots[b].cone = root.boundingCone;
+		}
+		removeSpill();
+
+		if (numBuckets > 1) {
+			// merge the bucket roots, which replace the leaves of the top tree
+			tree.SetLightType(LightCuts::LightType::REAL);
+			tree.Build(numBuckets, [&](int b) {return roots[b].color; },
+				[&](int b) {return (roots[b].node.boundMin + roots[b].node.boundMax) * 0.5f; },
+				[&](int b) {return roots[b].cone; },
+				[&](int b) {return aabb(roots[b].node.boundMin, roots[b].node.boundMax); }, seed);
+			globalBoundDiag = tree.globalBoundDiag;
+			tree.ExportGPUNodes(topNodes.data(), [](int b) { return -1 - b; });
+			for (int j = 1; j < 2 * numBuckets; j++) if (topNodes[j].ID < 0) topNodes[j] = roots[-1 - topNodes[j].ID].node;
+			out.seekp(fileHeader.nodeOffset);
+			out.write((const char*)topNodes.data(), topNodes.size() * sizeof(::Node));
+		}
+		fileHeader.globalBoundDiag = globalBoundDiag;
+		out.seekp(0);
+		out.write((const char*)&fileHeader, sizeof(fileHeader));
+		out.close();
+		return !out.fail();
+	}
+
+private:
+
+	// A light as it is spilled to its bucket
+	struct BucketLight
+	{
+		glm::vec3 pos;
+		glm::vec3 color;
+		glm::vec4 cone;
+		glm::vec3 boundMin;
+		glm::vec3 boundMax;
+		int lightID;
+	};
+
+	struct BucketRoot
+	{
+		::Node node;		// as written in the node file
+		CPUColor color;
+		glm::vec4 cone;
+	};
+
+	LightCuts::LightType lightType = LightCuts::LightType::REAL;
+	LightCuts::BuildMode buildMode = LightCuts::BuildMode::LOCALLY_ORDERED;
+	int maxLightsInMemory = 1 << 22;
+	float globalBoundDiag = 0.f;
+
+	LightCuts tree;	// builds the buckets and then the top tree
+	LightCuts::BuildWorkspace workspace;
+	std::vector<int> cellCounts;
+	std::vector<int> cellBuckets;	// the first bucket of each Morton cell
+	std::vector<int> bucketSizes;
+	std::vector<std::vector<int>> bucketBlocks;	// the blocks of each bucket in the spill file
+	std::vector<std::vector<BucketLight>> bucketBuffers;
+	std::vector<BucketLight> lights;	// the lights of the bucket being built
+	std::vector<::Node> bucketNodes;
+	std::vector<::Node> topNodes;
+	std::vector<BucketRoot> roots;
+};
@@ -24,33 +24,88 @@
 
 #pragma once
 #include <vector>
+#include <algorithm>
+#include <type_traits>
+#include <cstdint>
+#include <cstring>
+#include <ppl.h>
 #include "CPUColor.h"
 #include "CPUaabb.h"
-#include "cyPointCloud.h"
+#include "CPUDynamicPointCloud.h"
+#include "CPUSimd.h"
 #include "LightTreeMacros.h"
 //-------------------------------------------------------------------------------
 
-#define LIGHTCUTS_STOCHASTIC // great idea! When evaluating, randomly picks a light from a subtree as the representative. Needs reordering the tree.
+#define LIGHTCUTS_MIN_INTENSITY 0.000001f
+#define LIGHTCUTS_BIGFLOAT 1e30f
+
+#define LIGHTCUTS_LOCALLY_ORDERED_RADIUS 16	// search window of the locally-ordered builder (clusters on each side along the Morton curve)
+#define LIGHTCUTS_SAOH_BINS 12					// split candidates per axis of the top-down builder (more bins: better splits, slower build)
+#define LIGHTCUTS_REFIT_MAX_COST_RATIO 1.2f		// Refit, Insert and Remove ask for a rebuild when the tree cost grows this much over the last full build
+#define LIGHTCUTS_NN_CHAIN_SEARCH_SCALE 1.5f		// the chain builder looks for merge partners within this many times the distance to the closest light
+#define LIGHTCUTS_WIDE_WIDTH 8					// children per node of the collapsed tree used by SampleLight (a multiple of 4)
+#define LIGHTCUTS_REORDER_TASK_NODES 1024		// subtrees up to this many nodes are placed by one task of the parallel node reorder
+#define LIGHTCUTS_POWER_SWEEP_FRACTION 0.02f	// UpdatePower sweeps the whole tree instead of walking up from each light when more lights than this change
+#define LIGHTCUTS_BUILDER_VERSION 1				// part of the key of cached trees; bump it when a change to the builders changes the trees they build
 
 //-------------------------------------------------------------------------------
+// Sampling policies of LightCutsT. A policy selects how Eval picks the light that represents a cluster and
+// which data the nodes keep for it. The data of the features that a policy does not use is not stored.
 
-#ifdef LIGHTCUTS_STOCHASTIC
+// When evaluating, randomly picks a light from a subtree as the representative. Needs reordering the tree.
+struct LightCutsStochastic
+{
+	static const bool stochastic = true;
+	static const bool hierarchical = false;
+	static const int  repCount = 0;
 
-# define LIGHTCUTS_HIERARCHICAL 0.0001f // instead of picking a random light, traverses the hierarchy by randomly picking child nodes
-#else
+	struct TraversalData
+	{
+		float probTree;		// the total intensity within this subtree
+	};
+	struct NodeData
+	{
+		float probStart;	// the total intensity of the nodes up to this node
+		float probTree;
+	};
 
-# define LIGHTCUTS_REP_COUNT 32	// multiple representative lights (as suggested by multidimensional lightcuts)
+	struct SampleData
+	{
+		int sampledNodeID;
+	};
+};
 
-#endif
+// Instead of picking a random light, traverses the hierarchy by randomly picking child nodes
+struct LightCutsHierarchical : public LightCutsStochastic
+{
+	static const bool hierarchical = true;
+};
 
-//-------------------------------------------------------------------------------
+// Multiple representative lights (as suggested by multidimensional lightcuts)
+template <int RepCount>
+struct LightCutsRepresentative
+{
+	static const bool stochastic = false;
+	static const bool hierarchical = false;
+	static const int  repCount = RepCount;
 
-#define LIGHTCUTS_MIN_INTENSITY 0.000001f
-#define LIGHTCUTS_BIGFLOAT 1e30f
+	struct TraversalData {};
+	struct NodeData
+	{
+		std::vector<int>   nodeLights;
+		std::vector<float> nodeLightCDF;
+	};
+
+	struct SampleData
+	{
+		int sampledLightID;
+	};
+};
 
 //-------------------------------------------------------------------------------
 
-class LightCuts
+// The parts of the light cuts that do not depend on the policies
+class LightCutsBase
 {
 public:
 
@@ -60,368 +115,141 @@ public:
 		REAL
 	};
 
-	LightType lightType;
-	
-	float globalBoundDiag;
-
-	struct Node
+	enum class BuildMode
 	{
-#ifdef LIGHTCUTS_STOCHASTIC
-		float probStart;	// the total intensity of the nodes up to this node
-		float probTree;		// the total intensity within this subtree
-#endif
-
-		int    primaryChild;	// primary child must have the same position. If negative, no child
-		int    secondaryChild;
-		int    lightID;
-		CPUColor  color;
-		aabb   boundBox;
-
-#ifdef LIGHT_CONE
-		glm::vec4   boundingCone;
-#endif
-#ifdef LIGHTCUTS_REP_COUNT
-		std::vector<int>   nodeLights;
-		std::vector<float> nodeLightCDF;
-#endif
+		HEAP,				// serial agglomerative clustering, always merging the globally best pair
+		LOCALLY_ORDERED,	// parallel agglomerative clustering, merging all mutually-nearest pairs within a Morton window per round
+		TOP_DOWN_SAOH,		// parallel top-down splitting with the binned surface area orientation heuristic
+		NN_CHAIN			// serial agglomerative clustering, merging mutually-nearest pairs found by following nearest-neighbour chains
 	};
 
-	void SetLightType(LightType lightType) { this->lightType = lightType; }
-
-	template <typename LightColorFunc, typename LightPosFunc, typename LightConeFunc, typename BoundingBoxFunc, typename RandFunc>
-	void Build(int numLights, LightColorFunc lightColorFunc, LightPosFunc lightPosFunc, LightConeFunc lightConeFunc, BoundingBoxFunc boundingBoxFunc, RandFunc randFunc)
+	// Counter-based random number in [0, 1) of a build: a hash of the seed, the node and the draw within that node.
+	// It does not depend on the order in which the nodes are processed, so parallel builds are reproducible.
+	static float BuildRandom(uint32_t seed, uint32_t nodeID, uint32_t draw = 0)
 	{
-		// Initialize the light cut data
-		nodes.clear();
-		nodes.resize(numLights * 2 - 1);
-		for (int i = 0; i < numLights; i++) {
-			glm::vec3 p = lightPosFunc(i);
-			CPUColor c = lightColorFunc(i);
-			nodes[i + numLights - 1].lightID = i;
-			nodes[i + numLights - 1].color = c;
-			nodes[i + numLights - 1].boundBox = boundingBoxFunc(i);
+		uint32_t h = HashUint(HashUint(HashUint(seed) + nodeID) + draw);
+		return (h >> 8) * (1.0f / (1 << 24));
+	}
 
-			nodes[i + numLights - 1].primaryChild = -1;
-			nodes[i + numLights - 1].secondaryChild = -1;
-#ifdef LIGHT_CONE
-			nodes[i + numLights - 1].boundingCone = lightConeFunc(i);
-#endif
-#ifdef LIGHTCUTS_STOCHASTIC
-			nodes[i + numLights - 1].probTree = SumVal(c);
-			nodes[i + numLights - 1].probStart = nodes[i + numLights - 1].probTree; // temporarily storing the light intensity here
-#endif
-		}
-		// Create a point cloud of light positions
-		cy::PointCloud<glm::vec3, float, 3, int> pointCloud;
-		pointCloud.BuildWithFunc(numLights, lightPosFunc);
+	// A light tree of CompactNodes, with the root data that the nodes are relative to
+	struct CompactTree
+	{
+		std::vector<CompactNode> nodes;
+		aabb  rootBound;
+		float rootIntensity = 0;
+	};
 
-		float globalBoundDiag2 = 0.0f;
-		globalBoundDiag = 0.f;
-		if (numLights > 0) {
-			aabb gbound;
-			for (int i = 0; i < numLights; ++i) {
-				aabb bbox = boundingBoxFunc(i);
-				glm::vec3 p = lightPosFunc(i);
-				gbound.Union(bbox);
-			}
-			globalBoundDiag = gbound.diagonal_length();
-			globalBoundDiag2 = globalBoundDiag * globalBoundDiag;
+	// Decodes the box of a compact node from the decoded box of its parent
+	static aabb DecodeCompactBound(const CompactNode &node, const aabb &parentBound)
+	{
+		glm::vec3 extent = (parentBound.end - parentBound.pos) * (1.0f / 255);
+		aabb box;
+		for (int i = 0; i < 3; i++) {
+			box.pos[i] = DecodeCompactCoord((node.boundLo >> (8 * i)) & 0xFF, parentBound.pos[i], extent[i]);
 		}
+		box.end.x = DecodeCompactCoord(node.boundLo >> 24, parentBound.pos.x, extent.x);
+		box.end.y = DecodeCompactCoord(node.boundHiIntensity & 0xFF, parentBound.pos.y, extent.y);
+		box.end.z = DecodeCompactCoord((node.boundHiIntensity >> 8) & 0xFF, parentBound.pos.z, extent.z);
+		return box;
+	}
+	static float DecodeCompactCoord(uint32_t q, float parentMin, float extent) { return parentMin + float(q) * extent; }
 
-		// Create an array of closest light id and its distance
-		struct ClosestLight
-		{
-			int   id;
-			float weight;
-			float dist;
-		};
-		std::vector<ClosestLight> closestLights;
-		closestLights.resize(numLights);
-
-		// For each light, search the point cloud and find the closest light
-		float searchRadius = LIGHTCUTS_BIGFLOAT;
-		for (int i = 0; i < numLights; i++) {
-			int closestLightID = -1;
-			float distanceSquaredToClosestLight = LIGHTCUTS_BIGFLOAT;
-
-			for (int searchIter = 0; distanceSquaredToClosestLight == LIGHTCUTS_BIGFLOAT && searchIter < 100; searchIter++, searchRadius *= 2) {
-				pointCloud.GetPoints(lightPosFunc(i), searchRadius,
-					[&](int lightID, const glm::vec3 &pos, float distanceSquared, float &radiusSquared)
-					{
-						if (lightID != i) {
-							if (distanceSquared < distanceSquaredToClosestLight) {
-								closestLightID = lightID;
-								distanceSquaredToClosestLight = distanceSquared;
-								radiusSquared = distanceSquared; // This says "do not send me lights that are further away."
-							}
-						}
-					}
-				);
-			}
-			float dist = sqrtf(distanceSquaredToClosestLight);
-
-			searchRadius = dist * 2;
-			if (searchRadius == 0.f) searchRadius = 10.f;
+	static float DecodeCompactIntensity(const CompactNode &node, float parentIntensity)
+	{
+		return parentIntensity * HalfToFloat(node.boundHiIntensity >> 16);
+	}
 
-			// The closest light is found, we must compute the weight
-			float intensity0 = SumVal(nodes[i + numLights - 1].color);
-			float intensity1 = SumVal(nodes[closestLightID + numLights - 1].color);
-			float intensity = intensity0 + intensity1;
-#ifdef LIGHT_CONE
-			glm::vec4 boundingCone = MergeCones(nodes[i + numLights - 1].boundingCone, nodes[closestLightID + numLights - 1].boundingCone);
-			float coneAngleWeight = 1.0f - cosf(boundingCone.w);
-			distanceSquaredToClosestLight += coneAngleWeight * coneAngleWeight * globalBoundDiag2;
-#endif
-			float weight = distanceSquaredToClosestLight * intensity;
-			closestLights[i].id = closestLightID;
-			closestLights[i].weight = weight;
-			closestLights[i].dist = dist;
+	static glm::vec4 DecodeCompactCone(uint32_t cone)
+	{
+		glm::vec2 e(float(cone & 0xFFF), float((cone >> 12) & 0xFFF));
+		e = e * (2.0f / 4095) - 1.0f;
+		glm::vec3 axis(e.x, e.y, 1 - std::abs(e.x) - std::abs(e.y));
+		if (axis.z < 0) {
+			axis.x = (1 - std::abs(e.y)) * (e.x >= 0 ? 1.f : -1.f);
+			axis.y = (1 - std::abs(e.x)) * (e.y >= 0 ? 1.f : -1.f);
 		}
+		axis = glm::normalize(axis);
+		return glm::vec4(axis, float(cone >> 24) * (PI / 255));
+	}
 
-		class BuilderHeap
-		{
-		public:
-			struct Data
-			{
-				int lightID;
-				int closestLightID;
-				float weight;
-				float closestLightDist;
-			};
-			BuilderHeap(std::vector<ClosestLight> &closestLights, int N)
-			{
-				heap.resize(N + 1);
-				for (int i = 1; i <= N; i++) {
-					heap[i].lightID = i - 1;
-					heap[i].closestLightID = closestLights[i - 1].id;
-					heap[i].weight = closestLights[i - 1].weight;
-					heap[i].closestLightDist = closestLights[i - 1].dist;
-				}
-				if (N <= 1) return;
-				for (int i = N / 2; i > 0; i--) MoveDown(i, N);
-			}
-			void MoveHeadDown() { MoveDown(1, (int)heap.size() - 1); }
-
-			Data& Head() { return heap[1]; }
-		private:
-			std::vector<Data> heap;
-			void SwapItems(int ix1, int ix2) { Data tmp = heap[ix1]; heap[ix1] = heap[ix2]; heap[ix2] = tmp; }
-			void MoveDown(int ix, int N)
-			{
-				int child = ix * 2;
-				while (child + 1 <= N) {
-					if (heap[child + 1].weight < heap[child].weight) child++;
-					if (heap[ix].weight <= heap[child].weight) return;
-					SwapItems(ix, child);
-					ix = child;
-					child = ix * 2;
-				}
-				if (child <= N) {
-					if (heap[child].weight < heap[ix].weight) {
-						SwapItems(ix, child);
-					}
-				}
-			}
-		};
-
-		// Build a heap for the closest light distances, so we can quickly find the closest pair
-		BuilderHeap heap(closestLights, numLights);
-
-		// Create an array of light indices
-		std::vector<int> nodeIndex;
-		nodeIndex.resize(numLights);
-		for (int i = 0; i < numLights; i++) nodeIndex[i] = i + numLights - 1;
-
-		// Tree rebuild
-		int pointCloudSize = 0;
-		int nextPointCloudBuild = numLights > 8 ? numLights / 2 : -1;
-		std::vector<glm::vec3> rebuildPos;
-		std::vector<int> rebuildIndex;
-
-		// Take the elements from the heap one by one
-		int nextNodeIndex = numLights - 2;
-		while (nextNodeIndex >= 0) {
-			// Check if the light has already been used
-			int thisLightID = heap.Head().lightID;
-			if (nodeIndex[thisLightID] < 0) {
-				// The light has already been used, skip
-				heap.Head().weight = LIGHTCUTS_BIGFLOAT;
-				heap.MoveHeadDown();
+	// Picks a light with the hierarchical descent of Eval, decoding the nodes on the way down.
+	// Returns the light index and sets its probability, or returns -1 if no light can contribute.
+	static int SampleCompactLight(const CompactTree &tree, const glm::vec3 &p, const glm::vec3 &N, float r, float &prob)
+	{
+		if (tree.nodes.empty()) return -1;
+		ShadingFrame frame(p, N);
+		const CompactNode *node = &tree.nodes[0];
+		aabb box = tree.rootBound;
+		float intensity = tree.rootIntensity;
+		double nprob = 1;
+		while (node->ID >= 0) {
+			const CompactNode &node0 = tree.nodes[node->ID];
+			const CompactNode &node1 = tree.nodes[node->ID + 1];
+			aabb box0 = DecodeCompactBound(node0, box);
+			aabb box1 = DecodeCompactBound(node1, box);
+			float intensity0 = DecodeCompactIntensity(node0, intensity);
+			float intensity1 = DecodeCompactIntensity(node1, intensity);
+
+			float intensGeom0 = intensity0 * GeomTermBound(frame, box0);
+			float intensGeom1 = intensity1 * GeomTermBound(frame, box1);
+			if (intensGeom0 + intensGeom1 == 0) return -1;
+			float prob0 = DescentProb0(p, box0, box1, intensGeom0, intensGeom1);
+
+			if (r < prob0) {
+				node = &node0;
+				box = box0;
+				intensity = intensity0;
+				r /= prob0;
+				nprob *= prob0;
 			}
 			else {
-				// Check if its pair has already been used
-				int closestLightID = heap.Head().closestLightID;
-				if (nodeIndex[closestLightID] < 0) {
-					// The closest one has already been used,
-					// we must find another one
-					closestLightID = -1;
-					float distanceSquaredToClosestLight = LIGHTCUTS_BIGFLOAT;
-					float searchRadius = heap.Head().closestLightDist * 2;
-					if (searchRadius == 0.f) searchRadius = 0.1f;
-					for (int searchIter = 0; distanceSquaredToClosestLight == LIGHTCUTS_BIGFLOAT && searchIter < 100; searchIter++, searchRadius *= 2) {
-						pointCloud.GetPoints(
-							lightPosFunc(thisLightID),
-							searchRadius,
-							[&](int lightID, const glm::vec3 &pos, float distanceSquared, float &radiusSquared)
-							{
-								if (lightID != thisLightID) {
-									if (distanceSquared < distanceSquaredToClosestLight) {
-										// Check if the light was removed
-										if (nodeIndex[lightID] < 0) return;
-										closestLightID = lightID;
-										distanceSquaredToClosestLight = distanceSquared;
-										radiusSquared = distanceSquared; // This says "do not send me lights that are further away."
-									}
-								}
-							}
-						);
-					}
-					assert(closestLightID >= 0);
-					// The new closest light is found, we must recompute the weight
-					Node node0 = nodes[nodeIndex[thisLightID]];
-					Node node1 = nodes[nodeIndex[closestLightID]];
-					float intensity0 = SumVal(node0.color);
-					float intensity1 = SumVal(node1.color);
-					float intensity = intensity0 + intensity1;
-					aabb  boundBox = NodeBound(node0, node1);
-					float diag2 = dot(boundBox.end - boundBox.pos, boundBox.end - boundBox.pos);
-#ifdef LIGHT_CONE
-					glm::vec4 boundingCone = MergeCones(node0.boundingCone, node1.boundingCone);
-					float coneAngleWeight = 1.0f - cosf(boundingCone.w);
-					diag2 += coneAngleWeight * coneAngleWeight * globalBoundDiag2;
-#endif
-					float weight = diag2 * intensity;
-					heap.Head().closestLightID = closestLightID;
-					heap.Head().weight = weight;
-					heap.Head().closestLightDist = sqrtf(distanceSquaredToClosestLight);
-					heap.MoveHeadDown();
-				}
-				else {
-					// The light is in the heap, so we can merge with it
-					Node node0 = nodes[nodeIndex[thisLightID]];
-					Node node1 = nodes[nodeIndex[closestLightID]];
-					nodes[nextNodeIndex].color = node0.color + node1.color;
-					nodes[nextNodeIndex].boundBox = NodeBound(node0, node1);
-#ifdef LIGHT_CONE
-					nodes[nextNodeIndex].boundingCone = MergeCones(node0.boundingCone, node1.boundingCone);
-#endif
-					// pick the position randomly
-					float intensity0 = SumVal(node0.color);
-					float intensity1 = SumVal(node1.color);
-					float intensity = intensity0 + intensity1;
-					float r = randFunc() * intensity;
-
-					if (r < intensity0) {
-						// pick the first light
-						nodes[nextNodeIndex].lightID = node0.lightID;
-						nodes[nextNodeIndex].primaryChild = nodeIndex[thisLightID];
-						nodes[nextNodeIndex].secondaryChild = nodeIndex[closestLightID];
-						nodeIndex[closestLightID] = -1; // removed from consideration
-						nodeIndex[thisLightID] = nextNodeIndex;
-#ifdef LIGHTCUTS_STOCHASTIC
-						nodes[nextNodeIndex].probStart = 0;
-#endif
-					}
-					else {
-						// pick the second light
-						nodes[nextNodeIndex].lightID = node1.lightID;
-						nodes[nextNodeIndex].primaryChild = nodeIndex[closestLightID];
-						nodes[nextNodeIndex].secondaryChild = nodeIndex[thisLightID];
-						nodeIndex[thisLightID] = -1; // removed from consideration
-						nodeIndex[closestLightID] = nextNodeIndex;
-#ifdef LIGHTCUTS_STOCHASTIC
-						nodes[nextNodeIndex].probStart = 0;
-#endif
-					}
-#ifdef LIGHTCUTS_STOCHASTIC
-					nodes[nextNodeIndex].probTree = node0.probTree + node1.probTree;
-#endif
-					nextNodeIndex--;
-
-					if (nextNodeIndex < nextPointCloudBuild) {
-						int j = 0;
-						if (pointCloudSize == 0) {
-							rebuildPos.resize(numLights / 2 + 2);
-							rebuildIndex.resize(numLights / 2 + 2);
-							for (int i = 0; i < numLights; i++) {
-								// Check if the light was removed
-								if (nodeIndex[i] >= 0) {
-									rebuildPos[j] = lightPosFunc(i);
-									rebuildIndex[j] = i;
-									j++;
-								}
-							}
-						}
-						else {
-							for (int i = 0; i < pointCloudSize; i++) {
-								int ix = rebuildIndex[i];
-								// Check if the light was removed
-								if (nodeIndex[ix] >= 0) {
-									rebuildPos[j] = lightPosFunc(ix);
-									rebuildIndex[j] = ix;
-									j++;
-								}
-							}
-						}
-						pointCloudSize = j;
-						pointCloud.Build(pointCloudSize, rebuildPos.data(), rebuildIndex.data());
-						nextPointCloudBuild /= 2;
-						if (nextPointCloudBuild <= 4) nextPointCloudBuild = -1;
-					}
-				}
+				node = &node1;
+				box = box1;
+				intensity = intensity1;
+				r = (r - prob0) / (1 - prob0);
+				nprob *= (1 - prob0);
 			}
 		}
+		prob = float(nprob);
+		return -1 - node->ID;
+	}
 
-#ifdef LIGHTCUTS_STOCHASTIC
-		// Reorder
-		std::vector<int> oldIndices;
-		oldIndices.resize(2 * numLights - 1);
-		std::vector<int> stack;
-		stack.resize(numLights);
-		int stackPos = 0;
-		stack[0] = 0;
-		int index = 0;
-		oldIndices[index++] = 0;
-		while (stackPos >= 0) {
-			int ix = stack[stackPos--];
-			if (nodes[ix].primaryChild >= 0) {	// internal node
-				oldIndices[index++] = nodes[ix].primaryChild;
-				oldIndices[index++] = nodes[ix].secondaryChild;
-				stack[++stackPos] = nodes[ix].secondaryChild;
-				stack[++stackPos] = nodes[ix].primaryChild;
-			}
-		}
+	// The probability of picking the first child in the descents, from the child boxes and their intensities times GeomTermBound
+	static float DescentProb0(const glm::vec3 &p, const aabb &box0, const aabb &box1, float intensGeom0, float intensGeom1)
+	{
+		float l2_min0 = SquaredDistanceToClosestPoint(p, box0);
+		float l2_min1 = SquaredDistanceToClosestPoint(p, box1);
+		if (l2_min0 < box0.WidthSquared() || l2_min1 < box1.WidthSquared()) return intensGeom0 / (intensGeom0 + intensGeom1);
+		float ww0 = l2_min1 * intensGeom0;
+		float ww1 = l2_min0 * intensGeom1;
+		return ww0 / (ww0 + ww1);
+	}
 
-		float probStart = 0;
-		std::vector<int> newIndices;
-		newIndices.resize(2 * numLights - 1);
-		{	// order nodes
-			std::vector<Node> lightcutOrdered;
-			lightcutOrdered.resize(2 * numLights - 1);
-			for (int i = 0; i < 2 * numLights - 1; i++) {
-				int ix = oldIndices[i];
-				newIndices[ix] = i;
-				lightcutOrdered[i] = nodes[ix];
-				float prob = lightcutOrdered[i].probStart;
-				lightcutOrdered[i].probStart = probStart;
-				probStart += prob;
-			}
-			nodes.swap(lightcutOrdered);
-		}
-		// fix child node indices
-		for (int i = 0; i < 2 * numLights - 1; i++) {
-			if (nodes[i].primaryChild >= 0) {
-				nodes[i].primaryChild = (newIndices[nodes[i].primaryChild] + 1);
-				nodes[i].secondaryChild = (newIndices[nodes[i].secondaryChild] + 1);
-				assert(nodes[i].secondaryChild == nodes[i].primaryChild + 1);
-			}
-			else
-			{
-				nodes[i].primaryChild = 2 * numLights + nodes[i].lightID;
-			}
-		}
-#endif
-		InitNodeLights(randFunc);
+	// Half float conversions for values in [0, 65504], rounding to nearest
+	static uint32_t FloatToHalf(float f)
+	{
+		uint32_t x;
+		memcpy(&x, &f, sizeof(x));
+		if (x >= 0x477FF000) return 0x7BFF;	// clamp to the largest half
+		if (x < 0x38800000) return uint32_t(f * 16777216.0f + 0.5f);	// denormal half, which may round up to the smallest normal
+		return (x - 0x38000000 + 0x0FFF + ((x >> 13) & 1)) >> 13;
+	}
+	static float HalfToFloat(uint32_t h)
+	{
+		uint32_t e = (h >> 10) & 0x1F;
+		uint32_t m = h & 0x3FF;
+		return e == 0 ? float(m) * (1.0f / 16777216.0f) : ldexpf(float(m | 0x400), int(e) - 25);
+	}
+
+	// Integer hash with good avalanche (lowbias32 by Chris Wellons)
+	static uint32_t HashUint(uint32_t x)
+	{
+		x ^= x >> 16;
+		x *= 0x7feb352dU;
+		x ^= x >> 15;
+		x *= 0x846ca68bU;
+		x ^= x >> 16;
+		return x;
 	}
 
 	static float SquaredDistanceToClosestPoint(const glm::vec3 &p, const aabb &box)
@@ -443,8 +271,8 @@ public:
 	// Returns the maximum distance to the box along the given direction
 	static float MaxDistAlong(glm::vec3 const &p, glm::vec3 const &dir, aabb const &box)
 	{
-		float dmax = dot(dir, (box.pos - p));
-		for (int i = 1; i < 8; ++i) {
+		float dmax = -FLT_MAX;
+		for (int i = 0; i < 8; ++i) {
 			float d = dot(dir, (box[i] - p));
 			if (dmax < d) dmax = d;
 		}
@@ -453,11 +281,10 @@ public:
 	// Returns the absolute minimum distance to the box along the given direction
 	static float AbsMinDistAlong(glm::vec3 const &p, glm::vec3 const &dir, aabb const &box)
 	{
-		float dmin = dot(dir, (box.pos - p));
+		float dmin = FLT_MAX;
 		bool hasPositive = false;
 		bool hasNegative = false;
-		dmin = abs(dmin);
-		for (int i = 1; i < 8; ++i) {
+		for (int i = 0; i < 8; ++i) {
 			float d = dot(dir, (box[i] - p));
 			hasPositive |= d > 0;
 			hasNegative |= d < 0;
@@ -470,394 +297,2401 @@ public:
 	// Geometry term bound (actually cosine term for the shaded point)
 	static float GeomTermBound(glm::vec3 const &p, glm::vec3 const &N, aabb const &box)
 	{
-		float nrm_max = MaxDistAlong(p, N, box);
-		if (nrm_max <= 0) return 0.0f;
+		return GeomTermBound(ShadingFrame(p, N), box);
+	}
 
-		glm::vec3 T, B;
-		CoordinateSystem(N, &T, &B);
-		float y_amin = AbsMinDistAlong(p, T, box);
-		float z_amin = AbsMinDistAlong(p, B, box);
+	// A shading point with its normal and tangent frame, set up once to bound the distances to boxes along N, T and B together
+	struct ShadingFrame
+	{
+		glm::vec3 p;
+		glm::vec3 N;
+		SimdFloat4 dir[3];	// the x, y and z components of N, T and B
+
+		ShadingFrame() {}
+		ShadingFrame(const glm::vec3 &p, const glm::vec3 &N) : p(p), N(N)
+		{
+			glm::vec3 T, B;
+			CoordinateSystem(N, &T, &B);
+			SetDirections(T, B);
+		}
+		ShadingFrame(const glm::vec3 &p, const glm::vec3 &N, const glm::vec3 &T, const glm::vec3 &B) : p(p), N(N) { SetDirections(T, B); }
+
+	private:
+		void SetDirections(const glm::vec3 &T, const glm::vec3 &B)
+		{
+			for (int i = 0; i < 3; i++) dir[i] = SimdFloat4(N[i], T[i], B[i], 0);
+		}
+	};
+
+	// GeomTermBound with a precomputed frame. The distances to all 8 corners along a direction are sums of one term
+	// per axis, so their range comes from the two box planes of each axis, for N, T and B at once.
+	static float GeomTermBound(const ShadingFrame &frame, aabb const &box)
+	{
+		SimdFloat4 dmin(0.f), dmax(0.f);
+		for (int i = 0; i < 3; i++) {
+			SimdFloat4 d0 = frame.dir[i] * SimdFloat4(box.pos[i] - frame.p[i]);
+			SimdFloat4 d1 = frame.dir[i] * SimdFloat4(box.end[i] - frame.p[i]);
+			dmin = dmin + Min(d0, d1);
+			dmax = dmax + Max(d0, d1);
+		}
+		float mn[4], mx[4];
+		dmin.Store(mn);
+		dmax.Store(mx);
+
+		float nrm_max = mx[0];
+		if (nrm_max <= 0) return 0.0f;
+		float y_amin = mn[1] < 0 && mx[1] > 0 ? 0.f : std::min(abs(mn[1]), abs(mx[1]));
+		float z_amin = mn[2] < 0 && mx[2] > 0 ? 0.f : std::min(abs(mn[2]), abs(mx[2]));
 		float hyp = sqrtf(y_amin * y_amin + z_amin * z_amin + nrm_max * nrm_max);
 
 		return nrm_max / hyp;
 	}
 
-	struct LightHeapData
+	// The descent of SampleCompactLight on nodes in the GPU Node layout of ExportGPUNodes, from the node rootID,
+	// where the IDs from leafStart up are leaves. Returns the ID of the picked leaf, multiplies nprob by its
+	// probability and leaves r uniform in [0, 1) for a further descent. Returns -1 if no light can contribute.
+	static int SampleNodeLight(const ::Node *nodes, int rootID, int leafStart, const ShadingFrame &frame, float &r, double &nprob)
 	{
-		int    nodeID;
-		float  error;			// temporarily stores the error
-		double one_over_prob;	// and then the light probability
+		const ::Node *node = &nodes[rootID];
+		while (node->ID < leafStart) {
+			const ::Node &node0 = nodes[node->ID];
+			const ::Node &node1 = nodes[node->ID + 1];
+			aabb box0(node0.boundMin, node0.boundMax);
+			aabb box1(node1.boundMin, node1.boundMax);
+			float intensGeom0 = node0.intensity * GeomTermBound(frame, box0);
+			float intensGeom1 = node1.intensity * GeomTermBound(frame, box1);
+			if (intensGeom0 + intensGeom1 == 0) return -1;
+			float prob0 = DescentProb0(frame.p, box0, box1, intensGeom0, intensGeom1);
+
+			if (r < prob0) {
+				node = &node0;
+				r = std::min(r / prob0, 0.99999994f);
+				nprob *= prob0;
+			}
+			else {
+				node = &node1;
+				r = std::min((r - prob0) / (1 - prob0), 0.99999994f);
+				nprob *= (1 - prob0);
+			}
+		}
+		return node->ID;
+	}
+};
+
+//-------------------------------------------------------------------------------
+
+// SamplingPolicy is one of the sampling policies above. UseCones adds bounding cones to the nodes and to the merge weights.
+// All variants can be instantiated in the same binary, e.g. to compare them on a scene; LightCuts is the one the renderer uses.
+template <typename SamplingPolicy, bool UseCones>
+class LightCutsT : public LightCutsBase
+{
+public:
+
+	LightType lightType = LightType::REAL;
+
+	BuildMode buildMode = BuildMode::HEAP;
+	
+	float globalBoundDiag;
+
+	struct Node : public SamplingPolicy::NodeData
+	{
+		int    primaryChild;	// primary child must have the same position. If negative, no child
+		int    secondaryChild;
+		int    lightID;
 		CPUColor  color;
-		CPUColor  atten; // light color, including attenuation and visibility
-#ifdef LIGHTCUTS_STOCHASTIC
-		int    sampledNodeID;
-#elif defined(LIGHTCUTS_REP_COUNT)
-		int    sampledLightID;
-#endif
+		aabb   boundBox;
+		glm::vec4   boundingCone;	// only set with UseCones
 	};
 
-	template <typename AttenFunction, typename RandFunc>
-	CPUColor Eval(const glm::vec3 &p, const glm::vec3 &N, const glm::vec3 &T, const glm::vec3 &B, const glm::vec3 &wo,
-		float errorLimit, AttenFunction attenFunc, RandFunc nrandom) const
+	// The nodes are stored as a structure of arrays. The traversal array keeps only the fields that the Eval
+	// descent reads at every step (the hierarchical descent weighs both children by their bounds),
+	// while colors, cones and representative lights are in separate arrays.
+	struct TraversalNode : public SamplingPolicy::TraversalData
 	{
-		LightHeapData heap[101]; //this allows 1000 light samples
-		Eval(heap, 101, p, N, T, B, wo, bxdf, errorLimit, attenFunc, nrandom);
-		return heap[0].color;
+		int   primaryChild;	// primary child must have the same position. If negative, no child
+		int   secondaryChild;
+		int   lightID;
+		aabb  boundBox;
+	};
+
+	void SetLightType(LightType lightType) { this->lightType = lightType; }
+	void SetBuildMode(BuildMode buildMode) { this->buildMode = buildMode; }
+	BuildMode GetBuildMode() const { return buildMode; }
+
+	// The spatial quality measure that Refit compares against the last build, lower is better
+	float GetTreeCost()
+	{
+		if (refitOrder.empty()) InitRefitOrder();
+		return TreeCost();
 	}
 
-	template <typename HeapDataType, typename AttenFunc, typename RandFunc>
-	int Eval(HeapDataType *heap, int heapArraySize, const glm::vec3 &p, const glm::vec3 &N, const glm::vec3 &T, const glm::vec3 &B, const glm::vec3 &wo,
-		float errorLimit, AttenFunc attenFunc, RandFunc nrandom) const
+private:
+	// A node waiting to be placed by ReorderNodes: its new index and the new index of its first descendant
+	struct PlacedNode
 	{
-		return Eval(heap, heapArraySize, p, N, T, B, wo, bxdf, errorLimit, attenFunc,
-			[](const glm::vec3 &p, const glm::vec3 &N, int lightID, const CPUColor &color, const aabb &boundBox) {
-				float dlen2 = LightCuts::SquaredDistanceToClosestPoint(p, boundBox);
-				if (dlen2 < 1) dlen2 = 1; // bound the distance
-				float atten = 1 / dlen2;
+		int nodeID;
+		int newID;
+		int firstDescendant;
+	};
 
-				float colorIntens = GetColorIntensity(color);
-				return atten * colorIntens;
-			}, nrandom);
-	}
+	// A subtree waiting to be searched by FindInsertionSibling, with the weight its ancestors gain from the new leaf
+	struct InsertionCandidate
+	{
+		int nodeID;
+		float inheritedCost;
+		bool operator<(const InsertionCandidate &other) const { return inheritedCost > other.inheritedCost; }	// the cheapest first
+	};
 
-	// The first element of the heap array is not used.
-	template <typename HeapDataType, typename AttenFunc, typename ErrorFunc, typename RandFunc>
-	int Eval(HeapDataType *heap, int heapArraySize, const glm::vec3 &p, const glm::vec3 &N, const glm::vec3 &T, const glm::vec3 &B, const glm::vec3 &wo,
-		float errorLimit, AttenFunc attenFunc, ErrorFunc errorFunc, RandFunc nrandom) const
+	struct ClosestLight
 	{
-		auto errorFunction = [&](const glm::vec3 &p, const glm::vec3 &N, const Node &node)
-		{
-			if (node.primaryChild < 0) return 0.0f;
-			else return errorFunc(p, N, node.lightID, node.color, node.boundBox);
-		};
+		int   id;
+		float weight;
+	};
 
-#ifdef LIGHTCUTS_HIERARCHICAL
-		auto normalizedWeights = [](float l2_0, float l2_1, float intensGeom0, float intensGeom1)
-		{
-			float ww0 = l2_1 * intensGeom0;
-			float ww1 = l2_0 * intensGeom1;
-			return ww0 / (ww0 + ww1);
-		};
-		auto normalizedWeightsSafe = [&normalizedWeights](float l2_0, float l2_1, float intensGeom0, float intensGeom1)
+	class BuilderHeap
+	{
+	public:
+		struct Data
 		{
-			if (l2_0 + l2_1 < LIGHTCUTS_HIERARCHICAL) return intensGeom0 / (intensGeom0 + intensGeom1);
-			return normalizedWeights(l2_0, l2_1, intensGeom0, intensGeom1);
+			int lightID;
+			int closestLightID;
+			float weight;
 		};
-		auto firstChildWeight = [&](float &prob0, int child0, int child1)
+		BuilderHeap(std::vector<Data> &heap, const std::vector<ClosestLight> &closestLights, int N) : heap(heap)
 		{
-			Node const &c0 = nodes[child0];
-			Node const &c1 = nodes[child1];
-			// Compute the weights
-			float geom0 = LightCuts::GeomTermBound(p, N, c0.boundBox);
-			float geom1 = LightCuts::GeomTermBound(p, N, c1.boundBox);
-
-			if (geom0 + geom1 == 0) return false;
-			float intensGeom0 = c0.probTree*geom0;
-			float intensGeom1 = c1.probTree*geom1;
-			float l2_min0 = LightCuts::SquaredDistanceToClosestPoint(p, c0.boundBox);
-			float l2_min1 = LightCuts::SquaredDistanceToClosestPoint(p, c1.boundBox);
-
-			if (l2_min0 < c0.boundBox.WidthSquared() || l2_min1 < c1.boundBox.WidthSquared())
-			{
-				prob0 = intensGeom0 / (intensGeom0 + intensGeom1);
+			heap.resize(N + 1);
+			for (int i = 1; i <= N; i++) {
+				heap[i].lightID = i - 1;
+				heap[i].closestLightID = closestLights[i - 1].id;
+				heap[i].weight = closestLights[i - 1].weight;
 			}
-			else
-			{
-				float w_max0 = normalizedWeights(l2_min0, l2_min1, intensGeom0, intensGeom1);
-				prob0 = w_max0;	// closest point
-			}
-			return true;
-		};
-#endif
+			if (N <= 1) return;
+			for (int i = N / 2; i > 0; i--) MoveDown(i, N);
+		}
+		void MoveHeadDown() { MoveDown(1, (int)heap.size() - 1); }
 
-		auto computeNode = [&](HeapDataType &hd, int nodeID)
+		Data& Head() { return heap[1]; }
+	private:
+		std::vector<Data> &heap;
+		void SwapItems(int ix1, int ix2) { Data tmp = heap[ix1]; heap[ix1] = heap[ix2]; heap[ix2] = tmp; }
+		void MoveDown(int ix, int N)
 		{
-			int id = nodeID;
-#ifdef LIGHTCUTS_STOCHASTIC
-			hd.sampledNodeID = nodeID;
-# ifdef LIGHTCUTS_HIERARCHICAL
-			hd.one_over_prob = 1;
-			bool deadBranch = false;
-# endif
-			if (nodes[nodeID].primaryChild >= 0) {
-				float r = nrandom();
-# ifdef LIGHTCUTS_HIERARCHICAL
-				double nprob = 1;	// probability of picking that node
-# else
-				r = r * nodes[nodeID].probTree + nodes[nodeID].probStart;
-# endif
-				int nid = nodeID;
-
-				while (nodes[nid].secondaryChild >= 0) {
-					int c0 = nodes[nid].primaryChild;
-					int c1 = nodes[nid].secondaryChild;
-# ifdef LIGHTCUTS_HIERARCHICAL
-					float prob0;
-					if (firstChildWeight(prob0, c0, c1)) {
-						if (r < prob0) {
-							nid = c0;
-							r /= prob0;
-							nprob *= prob0;
-						}
-						else {
-							nid = c1;
-							r = (r - prob0) / (1 - prob0);
-							nprob *= (1 - prob0);
-						}
-					}
-					else {
-						deadBranch = true;
-						break;
+			int child = ix * 2;
+			while (child + 1 <= N) {
+				if (heap[child + 1].weight < heap[child].weight) child++;
+				if (heap[ix].weight <= heap[child].weight) return;
+				SwapItems(ix, child);
+				ix = child;
+				child = ix * 2;
+			}
+			if (child <= N) {
+				if (heap[child].weight < heap[ix].weight) {
+					SwapItems(ix, child);
+				}
+			}
+		}
+	};
+
+public:
+
+	// The scratch memory of Build. The arrays only grow, so once they have reached the size of the largest build
+	// the following builds do not allocate. A workspace can be shared by trees that are not built at the same time.
+	struct BuildWorkspace
+	{
+		DynamicPointCloud pointCloud;
+		std::vector<ClosestLight> closestLights;
+		std::vector<typename BuilderHeap::Data> heap;
+		std::vector<int> nodeIndex;
+		std::vector<int> chain;
+		std::vector<char> inChain;
+		std::vector<uint64_t> mortonKeys;
+		std::vector<int> clusters;
+		std::vector<int> nearest;
+		std::vector<int> mergeOffset;
+		std::vector<glm::vec3> lightPositions;
+		std::vector<glm::vec3> gatheredPositions;	// the positions of the Build from LightViews
+		std::vector<int> lightIDs;
+		std::vector<int> subtreeSizes;	// the number of nodes under each node, including itself, set by MergeNodes
+		std::vector<int> parents;		// the parent of each node during Insert and Remove
+		std::vector<int> leafNodes;		// the leaf of each light ID during Insert and Remove, -1 if the light is not in the tree
+		std::vector<InsertionCandidate> insertionQueue;
+		std::vector<PlacedNode> reorderStack;
+		std::vector<PlacedNode> reorderTasks;
+		std::vector<int> depths;
+		std::vector<int> next;
+		std::vector<ClosestLight> chainCandidates;	// the lights found by NearestByWeight, with their squared distance as the weight
+		// the arrays swapped with the node arrays by ReorderNodes
+		std::vector<TraversalNode> orderedNodes;
+		std::vector<CPUColor> orderedColors;
+		std::vector<glm::vec4> orderedCones;
+	};
+
+	// Builds with the given workspace instead of the one of this tree; nullptr goes back to the own one
+	void SetWorkspace(BuildWorkspace *workspace) { sharedWorkspace = workspace; }
+
+	// A strided view of one attribute per light in raw memory, e.g. a mapped readback of a float4 StructuredBuffer.
+	// The attribute of light i starts i * stride bytes after data.
+	struct AttributeView
+	{
+		const void *data;
+		size_t stride;
+		AttributeView(const void *data = nullptr, size_t stride = 4 * sizeof(float)) : data(data), stride(stride) {}
+		const float *operator[](int i) const { return reinterpret_cast<const float *>(static_cast<const char *>(data) + i * stride); }
+		glm::vec3 Vec3(int i) const { const float *v = (*this)[i]; return glm::vec3(v[0], v[1], v[2]); }
+		bool Empty() const { return data == nullptr; }
+	};
+
+	// The light attributes of Build. The views without data take the defaults in the comments.
+	struct LightViews
+	{
+		AttributeView positions;	// float3
+		AttributeView colors;		// float3
+		AttributeView coneAxes;		// float3, all directions; only read with UseCones
+		AttributeView coneAngles;	// float, 0
+		AttributeView boundMins;	// float3, the positions
+		AttributeView boundMaxs;	// float3, the positions
+	};
+
+	// Builds the tree from strided views. The positions are gathered once, so the builders read them from a packed array.
+	void Build(int numLights, const LightViews &views, uint32_t seed)
+	{
+		std::vector<glm::vec3> &positions = Workspace().gatheredPositions;
+		positions.resize(numLights);
+		concurrency::parallel_for(0, numLights, [&](int i) { positions[i] = views.positions.Vec3(i); });
+
+		const std::vector<glm::vec3> &lightPositions = positions;
+		Build(numLights,
+			[&](int i) { const float *c = views.colors[i]; return CPUColor(c[0], c[1], c[2]); },
+			[&](int i) { return lightPositions[i]; },
+			[&](int i) {
+				if (views.coneAxes.Empty()) return glm::vec4(0, 0, 1, PI);
+				return glm::vec4(views.coneAxes.Vec3(i), views.coneAngles.Empty() ? 0.f : *views.coneAngles[i]);
+			},
+			[&](int i) { return views.boundMins.Empty() ? aabb(lightPositions[i]) : aabb(views.boundMins.Vec3(i), views.boundMaxs.Vec3(i)); },
+			seed);
+	}
+
+	// Builds the tree. The random choices of the build are keyed on the seed and the node,
+	// so the same seed always gives the same tree, however the work is spread over the threads.
+	template <typename LightColorFunc, typename LightPosFunc, typename LightConeFunc, typename BoundingBoxFunc>
+	void Build(int numLights, LightColorFunc lightColorFunc, LightPosFunc lightPosFunc, LightConeFunc lightConeFunc, BoundingBoxFunc boundingBoxFunc, uint32_t seed)
+	{
+		buildSeed = seed;
+
+		// Initialize the light cut data
+		ResizeNodes(std::max(numLights * 2 - 1, 0));
+		std::vector<int> &subtreeSizes = Workspace().subtreeSizes;
+		subtreeSizes.resize(std::max(numLights * 2 - 1, 0));
+		for (int i = 0; i < numLights; i++) {
+			int leafID = i + numLights - 1;
+			subtreeSizes[leafID] = 1;
+			CPUColor c = lightColorFunc(i);
+			TraversalNode &leaf = traversalNodes[leafID];
+			leaf.lightID = i;
+			leaf.primaryChild = -1;
+			leaf.secondaryChild = -1;
+			leaf.boundBox = lightType == LightType::POINT ? aabb(lightPosFunc(i)) : boundingBoxFunc(i);
+			nodeColors[leafID] = c;
+			SetLightCone(leafID, i, lightConeFunc, Cones());
+			SetLeafProb(leaf, SumVal(c), Stochastic());
+		}
+
+		float globalBoundDiag2 = 0.0f;
+		globalBoundDiag = 0.f;
+		if (numLights > 0) {
+			aabb gbound;
+			for (int i = 0; i < numLights; ++i) gbound.Union(traversalNodes[i + numLights - 1].boundBox);
+			globalBoundDiag = gbound.diagonal_length();
+			globalBoundDiag2 = globalBoundDiag * globalBoundDiag;
+		}
+
+		// a single light is the root by itself, there is nothing to merge
+		if (numLights < 2) {}
+		else if (buildMode == BuildMode::LOCALLY_ORDERED) BuildLocallyOrdered(numLights, lightPosFunc, globalBoundDiag2);
+		else if (buildMode == BuildMode::TOP_DOWN_SAOH) BuildTopDown(numLights, lightPosFunc);
+		else if (buildMode == BuildMode::NN_CHAIN) BuildNNChain(numLights, lightPosFunc, globalBoundDiag2);
+		else BuildHeap(numLights, lightPosFunc, globalBoundDiag2);
+
+		// Reorder
+		ReorderNodes(numLights > 0 ? 0 : -1, Stochastic());
+		InitNodeLights(RepLights());
+	}
+
+	// Updates the tree to new light data, keeping its topology and representative lights.
+	// The bounds, cones and intensities are recomputed bottom-up, one tree level at a time in parallel.
+	// Returns false if the tree no longer matches the number of lights or if its cost has grown more than
+	// LIGHTCUTS_REFIT_MAX_COST_RATIO times over the last full build, in which case the caller should call Build.
+	template <typename LightColorFunc, typename LightPosFunc, typename LightConeFunc, typename BoundingBoxFunc>
+	bool Refit(int numLights, LightColorFunc lightColorFunc, LightPosFunc lightPosFunc, LightConeFunc lightConeFunc, BoundingBoxFunc boundingBoxFunc)
+	{
+		if (numLights < 2 || GetNumOfNodes() != 2 * numLights - 1) return false;
+		if (refitOrder.empty()) InitRefitOrder();
+		if (builtTreeCost < 0) builtTreeCost = TreeCost();
+
+		// leaves
+		concurrency::parallel_for(0, GetNumOfNodes(), [&](int nodeID)
+		{
+			TraversalNode &node = traversalNodes[nodeID];
+			if (node.primaryChild >= 0) return;
+			CPUColor c = lightColorFunc(node.lightID);
+			node.boundBox = lightType == LightType::POINT ? aabb(lightPosFunc(node.lightID)) : boundingBoxFunc(node.lightID);
+			nodeColors[nodeID] = c;
+			SetLightCone(nodeID, node.lightID, lightConeFunc, Cones());
+			SetLeafProb(node, SumVal(c), Stochastic());
+		});
+
+		// internal nodes, from the deepest level up
+		for (int level = (int)refitLevelOffsets.size() - 2; level >= 0; level--) {
+			concurrency::parallel_for(refitLevelOffsets[level], refitLevelOffsets[level + 1], [&](int i)
+			{
+				int nodeID = refitOrder[i];
+				TraversalNode &node = traversalNodes[nodeID];
+				TraversalNode const &node0 = traversalNodes[node.primaryChild];
+				TraversalNode const &node1 = traversalNodes[node.secondaryChild];
+				node.boundBox = NodeBound(node0.boundBox, node1.boundBox);
+				nodeColors[nodeID] = nodeColors[node.primaryChild] + nodeColors[node.secondaryChild];
+				if (UseCones) nodeCones[nodeID] = MergeCones(nodeCones[node.primaryChild], nodeCones[node.secondaryChild]);
+				MergeProb(node, node0, node1, Stochastic());
+			});
+		}
+
+		aabb gbound = traversalNodes[0].boundBox;
+		globalBoundDiag = gbound.diagonal_length();
+
+		UpdateRepLightCDFs(RepLights());
+		if (!wideNodes.empty()) BuildWideNodes();
+
+		return TreeCost() <= builtTreeCost * LIGHTCUTS_REFIT_MAX_COST_RATIO;
+	}
+
+	// Changes the colors of the given lights, for lights whose emission changes but not their position or shape.
+	// Only the colors and intensities of the nodes are updated, the topology and the representative lights are kept.
+	// The nodes are updated on the paths from the lights up to the root, which costs time proportional to the number
+	// of lights times the tree depth. With more than LIGHTCUTS_POWER_SWEEP_FRACTION of the lights, the whole tree is
+	// updated in one parallel bottom-up sweep instead. Lights that are not in the tree are ignored.
+	void UpdatePower(int count, const int *lightIDs, const CPUColor *colors)
+	{
+		static_assert(SamplingPolicy::stochastic, "the representative light CDFs are not updated");
+		int numNodes = GetNumOfNodes();
+		if (count <= 0 || numNodes == 0) return;
+		if (nodeParents.empty()) InitParentLinks();
+
+		auto setLeaf = [&](int i)
+		{
+			int lightID = lightIDs[i];
+			if (lightID < 0 || lightID >= (int)lightLeaves.size() || lightLeaves[lightID] < 0) return -1;
+			int leafID = lightLeaves[lightID];
+			nodeColors[leafID] = colors[i];
+			SetLeafProb(traversalNodes[leafID], SumVal(colors[i]), Stochastic());
+			UpdateWideIntensity(leafID);
+			return leafID;
+		};
+
+		if (count > (numNodes + 1) / 2 * LIGHTCUTS_POWER_SWEEP_FRACTION) {
+			if (refitOrder.empty()) InitRefitOrder();
+			concurrency::parallel_for(0, count, [&](int i) { setLeaf(i); });
+			for (int level = (int)refitLevelOffsets.size() - 2; level >= 0; level--) {
+				concurrency::parallel_for(refitLevelOffsets[level], refitLevelOffsets[level + 1], [&](int i) { UpdateNodePower(refitOrder[i]); });
+			}
+		}
+		else {
+			for (int i = 0; i < count; i++) {
+				int leafID = setLeaf(i);
+				if (leafID < 0) continue;
+				for (int nodeID = nodeParents[leafID]; nodeID >= 0; nodeID = nodeParents[nodeID]) UpdateNodePower(nodeID);
+			}
+		}
+	}
+
+	// Adds the lights with the given IDs to the tree without rebuilding it. The functions are called with the light IDs, as in Build.
+	// Each new leaf is paired with the cluster where it adds the least weight to the tree, and the bounds,
+	// intensities and representative lights are repaired on the path up from it. The nodes are then laid out depth first again.
+	// The IDs do not have to follow the ones already in the tree, but GPU leaves with gaps in the
+	// IDs need the leafID function of ExportGPUNodes. Insert a batch of lights at once: the layout pass is linear in the tree size.
+	// Negative IDs and IDs that are already in the tree are skipped.
+	// Returns false if the tree cost has grown more than LIGHTCUTS_REFIT_MAX_COST_RATIO times over the last full build,
+	// in which case the caller should call Build.
+	template <typename LightColorFunc, typename LightPosFunc, typename LightConeFunc, typename BoundingBoxFunc>
+	bool Insert(int count, const int *lightIDs, LightColorFunc lightColorFunc, LightPosFunc lightPosFunc, LightConeFunc lightConeFunc, BoundingBoxFunc boundingBoxFunc)
+	{
+		static_assert(SamplingPolicy::stochastic, "the representative lights of the nodes cannot be updated");
+		int rootID = BeginEdit();
+		BuildWorkspace &workspace = Workspace();
+		std::vector<int> &parents = workspace.parents;
+		std::vector<int> &leafNodes = workspace.leafNodes;
+		for (int i = 0; i < count; i++) {
+			int lightID = lightIDs[i];
+			if (lightID < 0) continue;
+			if (lightID >= (int)leafNodes.size()) leafNodes.resize(lightID + 1, -1);
+			if (leafNodes[lightID] >= 0) continue;
+
+			int leafID = AddEditNode();
+			CPUColor c = lightColorFunc(lightID);
+			TraversalNode &leaf = traversalNodes[leafID];
+			leaf.lightID = lightID;
+			leaf.primaryChild = -1;
+			leaf.secondaryChild = -1;
+			leaf.boundBox = lightType == LightType::POINT ? aabb(lightPosFunc(lightID)) : boundingBoxFunc(lightID);
+			nodeColors[leafID] = c;
+			SetLightCone(leafID, lightID, lightConeFunc, Cones());
+			SetLeafProb(leaf, SumVal(c), Stochastic());
+			leafNodes[lightID] = leafID;
+			if (rootID < 0) {
+				rootID = leafID;
+				continue;
+			}
+
+			// the new internal node takes the place of the sibling
+			float globalBoundDiag2 = NodeBound(traversalNodes[rootID].boundBox, leaf.boundBox).WidthSquared();
+			int siblingID = FindInsertionSibling(rootID, leafID, globalBoundDiag2);
+			int parentID = parents[siblingID];
+			int nodeID = AddEditNode();
+			MergeNodes(nodeID, siblingID, leafID);
+			editTreeCost += NodeCost(nodeID);
+			parents[nodeID] = parentID;
+			parents[siblingID] = nodeID;
+			parents[leafID] = nodeID;
+			if (parentID < 0) rootID = nodeID;
+			else ReplaceChild(parentID, siblingID, nodeID);
+			RepairPath(parentID);
+		}
+		return EndEdit(rootID);
+	}
+
+	// Removes the lights with the given IDs from the tree without rebuilding it. The sibling of each removed leaf takes the place
+	// of their parent, and the path up from it is repaired as in Insert. The IDs of the other lights do not change.
+	// IDs that are negative or not in the tree are skipped. Returns false if the tree cost has grown too much, as Insert.
+	bool Remove(int count, const int *lightIDs)
+	{
+		static_assert(SamplingPolicy::stochastic, "the representative lights of the nodes cannot be updated");
+		int rootID = BeginEdit();
+		BuildWorkspace &workspace = Workspace();
+		std::vector<int> &parents = workspace.parents;
+		std::vector<int> &leafNodes = workspace.leafNodes;
+		for (int i = 0; i < count; i++) {
+			int lightID = lightIDs[i];
+			if (lightID < 0 || lightID >= (int)leafNodes.size() || leafNodes[lightID] < 0) continue;
+			int leafID = leafNodes[lightID];
+			leafNodes[lightID] = -1;
+			int parentID = parents[leafID];
+			if (parentID < 0) {	// the last light
+				rootID = -1;
+				continue;
+			}
+			TraversalNode const &parent = traversalNodes[parentID];
+			int siblingID = parent.primaryChild == leafID ? parent.secondaryChild : parent.primaryChild;
+			int grandParentID = parents[parentID];
+			editTreeCost -= NodeCost(parentID);
+			parents[siblingID] = grandParentID;
+			if (grandParentID < 0) rootID = siblingID;
+			else ReplaceChild(grandParentID, parentID, siblingID);
+			RepairPath(grandParentID);
+		}
+		return EndEdit(rootID);
+	}
+
+	struct LightHeapData : public SamplingPolicy::SampleData
+	{
+		int    nodeID;
+		float  error;			// temporarily stores the error
+		double one_over_prob;	// and then the light probability
+		CPUColor  color;
+		CPUColor  atten; // light color, including attenuation and visibility
+	};
+
+	template <typename AttenFunction, typename RandFunc>
+	CPUColor Eval(const glm::vec3 &p, const glm::vec3 &N, const glm::vec3 &T, const glm::vec3 &B, const glm::vec3 &wo,
+		float errorLimit, AttenFunction attenFunc, RandFunc nrandom) const
+	{
+		LightHeapData heap[101]; //this allows 1000 light samples
+		Eval(heap, 101, p, N, T, B, wo, errorLimit, attenFunc, nrandom);
+		return heap[0].color;
+	}
+
+	template <typename HeapDataType, typename AttenFunc, typename RandFunc>
+	int Eval(HeapDataType *heap, int heapArraySize, const glm::vec3 &p, const glm::vec3 &N, const glm::vec3 &T, const glm::vec3 &B, const glm::vec3 &wo,
+		float errorLimit, AttenFunc attenFunc, RandFunc nrandom) const
+	{
+		return Eval(heap, heapArraySize, p, N, T, B, wo, errorLimit, attenFunc,
+			[](const glm::vec3 &p, const glm::vec3 &N, int lightID, const CPUColor &color, const aabb &boundBox) {
+				float dlen2 = SquaredDistanceToClosestPoint(p, boundBox);
+				if (dlen2 < 1) dlen2 = 1; // bound the distance
+				float atten = 1 / dlen2;
+
+				float colorIntens = GetColorIntensity(color);
+				return atten * colorIntens;
+			}, nrandom);
+	}
+
+	// The first element of the heap array is not used.
+	template <typename HeapDataType, typename AttenFunc, typename ErrorFunc, typename RandFunc>
+	int Eval(HeapDataType *heap, int heapArraySize, const glm::vec3 &p, const glm::vec3 &N, const glm::vec3 &T, const glm::vec3 &B, const glm::vec3 &wo,
+		float errorLimit, AttenFunc attenFunc, ErrorFunc errorFunc, RandFunc nrandom) const
+	{
+		ShadingFrame frame(p, N, T, B);
+		SampleNode(heap[1], 0, frame, attenFunc, nrandom, SamplingPolicy());
+		heap[1].error = NodeError(frame, 0, errorFunc);
+		int numLights = 1;
+		CPUColor color = heap[1].color;
+
+		while (CanRefine(heap, heapArraySize, numLights, color, errorLimit)) {
+			RefineCut(heap, numLights, color, frame, attenFunc, errorFunc, nrandom);
+		}
+
+		heap[0].nodeID = numLights;
+		heap[0].color = color;
+
+		SetSampleProbs(heap, numLights, SamplingPolicy());
+		return numLights;
+	}
+
+	// A packet of shading points for EvalPacket. Only the first count lanes are evaluated.
+	template <int Width>
+	struct ShadingPacket
+	{
+		glm::vec3 p[Width];
+		glm::vec3 N[Width];
+		glm::vec3 wo[Width];
+		int count;
+	};
+
+	// Evaluates the shading points of a packet; the same as calling Eval for each of them.
+	// The heap of lane l starts at heaps + l * heapArraySize and its number of lights is written to numLights[l].
+	// The callbacks also get the lane: attenFunc(lane, lightID, heapData) and nrandom(lane).
+	// With hierarchical sampling, the lanes refine their cuts in lockstep and the node bounds of all lanes are tested
+	// together with SIMD. Once fewer than half of the lanes are still refining, the others are finished one by one.
+	template <int Width, typename HeapDataType, typename AttenFunc, typename ErrorFunc, typename RandFunc>
+	void EvalPacket(HeapDataType *heaps, int heapArraySize, const ShadingPacket<Width> &packet, float errorLimit,
+		AttenFunc attenFunc, ErrorFunc errorFunc, RandFunc nrandom, int *numLights) const
+	{
+		EvalPacket(heaps, heapArraySize, packet, errorLimit, attenFunc, errorFunc, nrandom, numLights, SamplingPolicy());
+	}
+
+	Node GetNode(int id) const
+	{
+		TraversalNode const &tn = traversalNodes[id];
+		Node node;
+		SetNodeSampleData(node, id, Stochastic());
+		node.lightID = tn.lightID;
+		node.color = nodeColors[id];
+		node.boundBox = tn.boundBox;
+		if (UseCones) node.boundingCone = nodeCones[id];
+		return node;
+	}
+
+	int GetNumOfNodes() const {
+		return traversalNodes.size();
+	}
+
+	// Writes the tree in the GPU Node layout of LightTreeMacros.h, without going through GetNode.
+	// Node i goes to dst[i + 1] and dst[0] is not written, so dst needs GetNumOfNodes() + 1 entries.
+	// Internal nodes point at their primary child, which the secondary child follows. Leaves point at
+	// leafID(lightID), by default 2 * numLights + lightID as in GetNode.
+	template <typename LeafIDFunc>
+	void ExportGPUNodes(::Node *dst, LeafIDFunc leafID) const
+	{
+		static_assert(SamplingPolicy::stochastic, "the GPU layout needs the siblings next to each other");
+		concurrency::parallel_for(0, GetNumOfNodes(), [&](int id)
+		{
+			TraversalNode const &tn = traversalNodes[id];
+			::Node &node = dst[id + 1];
+			node.boundMin = tn.boundBox.pos;
+			node.boundMax = tn.boundBox.end;
+			node.intensity = tn.probTree;
+			node.ID = tn.primaryChild >= 0 ? tn.primaryChild + 1 : leafID(tn.lightID);
+#ifdef LIGHT_CONE
+			node.cone = UseCones ? nodeCones[id] : glm::vec4(0, 0, 1, PI);
+#endif
+		});
+	}
+	void ExportGPUNodes(::Node *dst) const
+	{
+		int numNodes = GetNumOfNodes() + 1;
+		ExportGPUNodes(dst, [numNodes](int lightID) { return numNodes + lightID; });
+	}
+
+	// Encodes the tree in the compressed CompactNode format, node i of GetNode at index i.
+	// The children are encoded relative to the decoded parent, so the bounds stay conservative and the intensity errors do not add up.
+	void GetCompactTree(CompactTree &tree) const
+	{
+		static_assert(SamplingPolicy::stochastic, "the compact format needs the siblings next to each other");
+		int numNodes = GetNumOfNodes();
+		tree.nodes.resize(numNodes);
+		if (numNodes == 0) return;
+		tree.rootBound = traversalNodes[0].boundBox;
+		tree.rootIntensity = SumVal(nodeColors[0]);
+
+		// parents precede their children, so the decoded data of a parent is always ready
+		std::vector<aabb> decodedBounds(numNodes);
+		std::vector<float> decodedIntensities(numNodes);
+		decodedBounds[0] = tree.rootBound;
+		decodedIntensities[0] = tree.rootIntensity;
+		EncodeCompactNode(tree.nodes[0], 0, tree.rootBound, tree.rootIntensity);
+		for (int id = 0; id < numNodes; id++) {
+			TraversalNode const &tn = traversalNodes[id];
+			if (tn.primaryChild < 0) continue;
+			for (int c = tn.primaryChild; c <= tn.secondaryChild; c++) {
+				EncodeCompactNode(tree.nodes[c], c, decodedBounds[id], decodedIntensities[id]);
+				decodedBounds[c] = DecodeCompactBound(tree.nodes[c], decodedBounds[id]);
+				decodedIntensities[c] = DecodeCompactIntensity(tree.nodes[c], decodedIntensities[id]);
+			}
+		}
+	}
+
+	// A node of the collapsed tree with the data of all of its children, LIGHTCUTS_WIDE_WIDTH of each, side by side
+	struct WideNode
+	{
+		float boundMin[3][LIGHTCUTS_WIDE_WIDTH];
+		float boundMax[3][LIGHTCUTS_WIDE_WIDTH];
+		float intensity[LIGHTCUTS_WIDE_WIDTH];	// zero for the unused children
+		int   child[LIGHTCUTS_WIDE_WIDTH];		// the wide node of an internal child, or -1 - the light index of a leaf
+	};
+
+	// Collapses the binary tree into nodes with up to LIGHTCUTS_WIDE_WIDTH children for SampleLight.
+	// Each node takes the binary subtree of its root, repeatedly opening the internal child with the largest
+	// spatial cost (squared diagonal times intensity) until it is full. Refit, Insert and Remove rebuild the wide nodes, UpdatePower updates their intensities, Build clears them.
+	void BuildWideNodes()
+	{
+		const int width = LIGHTCUTS_WIDE_WIDTH;
+		wideNodes.clear();
+		wideSlots.assign(GetNumOfNodes(), -1);
+		if (traversalNodes.empty()) return;
+		std::vector<int> wideRoots(1, 0);	// the binary node that each wide node replaces
+		for (size_t w = 0; w < wideRoots.size(); w++) {
+			int children[width];
+			int count = 0;
+			int root = wideRoots[w];
+			if (traversalNodes[root].primaryChild < 0) children[count++] = root;
+			else {
+				children[count++] = traversalNodes[root].primaryChild;
+				children[count++] = traversalNodes[root].secondaryChild;
+			}
+			while (count < width) {
+				int open = -1;
+				float openCost = -1;
+				for (int i = 0; i < count; i++) {
+					int nodeID = children[i];
+					if (traversalNodes[nodeID].primaryChild < 0) continue;
+					float cost = traversalNodes[nodeID].boundBox.WidthSquared() * SumVal(nodeColors[nodeID]);
+					if (cost > openCost) {
+						open = i;
+						openCost = cost;
+					}
+				}
+				if (open < 0) break;
+				int nodeID = children[open];
+				children[open] = traversalNodes[nodeID].primaryChild;
+				children[count++] = traversalNodes[nodeID].secondaryChild;
+			}
+
+			WideNode node = {};
+			for (int i = 0; i < count; i++) {
+				TraversalNode const &child = traversalNodes[children[i]];
+				for (int j = 0; j < 3; j++) {
+					node.boundMin[j][i] = child.boundBox.pos[j];
+					node.boundMax[j][i] = child.boundBox.end[j];
+				}
+				node.intensity[i] = SumVal(nodeColors[children[i]]);
+				wideSlots[children[i]] = int(wideNodes.size()) * width + i;
+				if (child.primaryChild < 0) node.child[i] = -1 - child.lightID;
+				else {
+					node.child[i] = (int)wideRoots.size();
+					wideRoots.push_back(children[i]);
+				}
+			}
+			wideNodes.push_back(node);
+		}
+	}
+
+	// Picks a light for the shading point with the importance of the hierarchical descent of Eval,
+	// testing the bounds of all children of a wide node at once. Requires BuildWideNodes.
+	// Returns the light index and sets its probability, or returns -1 if no light can contribute,
+	// which includes an empty tree and a tree without wide nodes.
+	int SampleLight(const glm::vec3 &p, const glm::vec3 &N, float r, float &prob) const
+	{
+		if (wideNodes.empty()) return -1;
+		const int width = LIGHTCUTS_WIDE_WIDTH;
+		glm::vec3 T, B;
+		CoordinateSystem(N, &T, &B);
+		SimdFrame<width> frame(p, N, T, B);
+		SimdFloat<width> zero(0);
+		double nprob = 1;
+		int w = 0;
+		while (true) {
+			const WideNode &node = wideNodes[w];
+			PacketBox<width> box;
+			for (int j = 0; j < 3; j++) {
+				box.lo[j] = SimdFloat<width>::Load(node.boundMin[j]);
+				box.hi[j] = SimdFloat<width>::Load(node.boundMax[j]);
+			}
+			SimdFloat<width> intensity = SimdFloat<width>::Load(node.intensity);
+			SimdFloat<width> intensGeom = intensity * GeomTermBoundPacket(frame, box);
+			SimdFloat<width> l2_min = SquaredDistanceToClosestPointPacket(frame, box);
+
+			// the same weights as FirstChildWeight: intensities only if the point is close to a child, inverse squared distances otherwise.
+			// The distances are clamped to the smallest one of the children that contribute and the weights are scaled by it, which
+			// keeps them finite next to a point light and gives the ratios of the cross-multiplied distances of FirstChildWeight.
+			float weights[width];
+			if (((l2_min < WidthSquaredPacket(box)) & (intensity > zero)).MoveMask()) intensGeom.Store(weights);
+			else {
+				float dist2[width];
+				Select(intensGeom > zero, l2_min, SimdFloat<width>(FLT_MAX)).Store(dist2);
+				float minDist2 = dist2[0];
+				for (int i = 1; i < width; i++) minDist2 = std::min(minDist2, dist2[i]);
+				SimdFloat<width> minL2(minDist2);
+				if (minDist2 > 0) (intensGeom * minL2 / Max(l2_min, minL2)).Store(weights);
+				else Select(l2_min == zero, intensGeom, zero).Store(weights);	// only the children the point is on
+			}
+			float total = 0;
+			for (int i = 0; i < width; i++) total += weights[i];
+			if (!(total > 0)) return -1;
+
+			// pick a child and reuse the random number
+			int pick = 0;
+			float target = r * total;
+			float start = 0;
+			for (; pick < width - 1; pick++) {
+				if (weights[pick] > 0 && target < start + weights[pick]) break;
+				start += weights[pick];
+			}
+			while (weights[pick] <= 0) pick--;	// rounding at the end of the range
+			r = std::min((target - start) / weights[pick], 0.99999994f);
+			r = std::max(r, 0.f);
+			nprob *= weights[pick] / total;
+
+			if (node.child[pick] < 0) {
+				prob = float(nprob);
+				return -1 - node.child[pick];
+			}
+			w = node.child[pick];
+		}
+	}
+
+private:
+	std::vector<TraversalNode> traversalNodes;
+	std::vector<CPUColor> nodeColors;
+	std::vector<glm::vec4> nodeCones;	// empty without UseCones
+	// The representative lights of internal node i are in the slots [i * repCount, i * repCount + repLightCounts[i]).
+	// Leaves have no slots and a zero count. Empty without representative lights.
+	std::vector<int>   repLights;
+	std::vector<float> repLightCDFs;
+	std::vector<int>   repLightCounts;
+
+	// Compile-time switches of the policies
+	typedef std::integral_constant<bool, SamplingPolicy::stochastic> Stochastic;
+	typedef std::integral_constant<bool, (SamplingPolicy::repCount > 0)> RepLights;
+	typedef std::integral_constant<bool, UseCones> Cones;
+
+	// Internal nodes sorted by their depth for Refit; the nodes of level l are refitOrder[refitLevelOffsets[l], refitLevelOffsets[l + 1])
+	std::vector<int> refitOrder;
+	std::vector<int> refitLevelOffsets;
+	std::vector<float> refitCosts;
+	float builtTreeCost = -1;	// the TreeCost of the last full build, -1 until it is needed
+	double editTreeCost = 0;	// the sum of NodeCost over the internal nodes, kept up to date by Insert and Remove
+	uint32_t buildSeed = 0;
+
+	std::vector<WideNode> wideNodes;	// the collapsed tree, empty until BuildWideNodes
+	std::vector<int> wideSlots;			// the wide node index times LIGHTCUTS_WIDE_WIDTH plus the child of each binary node, -1 for the root
+
+	// The links that UpdatePower walks up, empty until it is first called on the current tree
+	std::vector<int> nodeParents;
+	std::vector<int> lightLeaves;	// the leaf of each light ID, -1 if the light is not in the tree
+
+	BuildWorkspace ownWorkspace;
+	BuildWorkspace *sharedWorkspace = nullptr;
+	BuildWorkspace &Workspace() { return sharedWorkspace ? *sharedWorkspace : ownWorkspace; }
+
+	void InitRefitOrder()
+	{
+		// parents always precede their children in the node array
+		int numNodes = GetNumOfNodes();
+		std::vector<int> &depths = Workspace().depths;
+		depths.assign(numNodes, 0);
+		int maxDepth = 0;
+		for (int nodeID = 0; nodeID < numNodes; nodeID++) {
+			TraversalNode const &node = traversalNodes[nodeID];
+			if (node.primaryChild < 0) continue;
+			depths[node.primaryChild] = depths[nodeID] + 1;
+			depths[node.secondaryChild] = depths[nodeID] + 1;
+			maxDepth = std::max(maxDepth, depths[nodeID]);
+		}
+		refitLevelOffsets.assign(maxDepth + 2, 0);
+		for (int nodeID = 0; nodeID < numNodes; nodeID++) {
+			if (traversalNodes[nodeID].primaryChild >= 0) refitLevelOffsets[depths[nodeID] + 1]++;
+		}
+		for (int level = 0; level <= maxDepth; level++) refitLevelOffsets[level + 1] += refitLevelOffsets[level];
+		refitOrder.resize(refitLevelOffsets[maxDepth + 1]);
+		std::vector<int> &next = Workspace().next;
+		next.assign(refitLevelOffsets.begin(), refitLevelOffsets.end() - 1);
+		for (int nodeID = 0; nodeID < numNodes; nodeID++) {
+			if (traversalNodes[nodeID].primaryChild >= 0) refitOrder[next[depths[nodeID]]++] = nodeID;
+		}
+	}
+
+	// Spatial quality measure of the tree: the sum of squared diagonal times intensity of all internal nodes,
+	// relative to the scene size and total intensity
+	float TreeCost()
+	{
+		float globalBoundDiag2 = globalBoundDiag * globalBoundDiag;
+		float rootIntensity = SumVal(nodeColors[0]);
+		if (globalBoundDiag2 <= 0 || rootIntensity <= 0) return 0;
+		refitCosts.resize(refitOrder.size());
+		concurrency::parallel_for(0, (int)refitOrder.size(), [&](int i)
+		{
+			refitCosts[i] = NodeCost(refitOrder[i]);
+		});
+		double cost = 0;
+		for (float c : refitCosts) cost += c;
+		return float(cost / (globalBoundDiag2 * rootIntensity));
+	}
+
+	void InitParentLinks()
+	{
+		int numNodes = GetNumOfNodes();
+		nodeParents.resize(numNodes);
+		int numLightIDs = 0;
+		for (TraversalNode const &node : traversalNodes) {
+			if (node.primaryChild < 0) numLightIDs = std::max(numLightIDs, node.lightID + 1);
+		}
+		lightLeaves.assign(numLightIDs, -1);
+		nodeParents[0] = -1;
+		concurrency::parallel_for(0, numNodes, [&](int nodeID)
+		{
+			TraversalNode const &node = traversalNodes[nodeID];
+			if (node.primaryChild >= 0) {
+				nodeParents[node.primaryChild] = nodeID;
+				nodeParents[node.secondaryChild] = nodeID;
+			}
+			else lightLeaves[node.lightID] = nodeID;
+		});
+	}
+
+	// Recomputes the color and intensity of an internal node from its children
+	void UpdateNodePower(int nodeID)
+	{
+		TraversalNode &node = traversalNodes[nodeID];
+		nodeColors[nodeID] = nodeColors[node.primaryChild] + nodeColors[node.secondaryChild];
+		MergeProb(node, traversalNodes[node.primaryChild], traversalNodes[node.secondaryChild], Stochastic());
+		UpdateWideIntensity(nodeID);
+	}
+
+	void UpdateWideIntensity(int nodeID)
+	{
+		if (wideSlots.empty() || wideSlots[nodeID] < 0) return;
+		int slot = wideSlots[nodeID];
+		wideNodes[slot / LIGHTCUTS_WIDE_WIDTH].intensity[slot % LIGHTCUTS_WIDE_WIDTH] = SumVal(nodeColors[nodeID]);
+	}
+
+	float NodeCost(int nodeID) const { return traversalNodes[nodeID].boundBox.WidthSquared() * SumVal(nodeColors[nodeID]); }
+
+	// Sets up the parents, subtree sizes and light leaves of the workspace and the tree cost for Insert and Remove.
+	// Returns the root, or -1 if the tree is empty.
+	int BeginEdit()
+	{
+		BuildWorkspace &workspace = Workspace();
+		std::vector<int> &parents = workspace.parents;
+		std::vector<int> &subtreeSizes = workspace.subtreeSizes;
+		std::vector<int> &leafNodes = workspace.leafNodes;
+		int numNodes = GetNumOfNodes();
+		parents.resize(numNodes);
+		subtreeSizes.resize(numNodes);
+		leafNodes.clear();
+
+		// children follow their parents, so the subtrees are complete when a node is reached backwards
+		editTreeCost = 0;
+		for (int nodeID = numNodes - 1; nodeID >= 0; nodeID--) {
+			TraversalNode const &node = traversalNodes[nodeID];
+			if (node.primaryChild >= 0) {
+				parents[node.primaryChild] = nodeID;
+				parents[node.secondaryChild] = nodeID;
+				subtreeSizes[nodeID] = subtreeSizes[node.primaryChild] + subtreeSizes[node.secondaryChild] + 1;
+				editTreeCost += NodeCost(nodeID);
+			}
+			else {
+				subtreeSizes[nodeID] = 1;
+				if (node.lightID >= (int)leafNodes.size()) leafNodes.resize(node.lightID + 1, -1);
+				leafNodes[node.lightID] = nodeID;
+			}
+		}
+		if (numNodes == 0) return -1;
+		parents[0] = -1;
+		if (builtTreeCost < 0) builtTreeCost = EditedTreeCost(0);
+		return 0;
+	}
+
+	// Lays out the edited tree from the given root and invalidates the data that depends on the old layout.
+	// Returns true if the tree cost is still within LIGHTCUTS_REFIT_MAX_COST_RATIO of the last full build.
+	bool EndEdit(int rootID)
+	{
+		if (rootID < 0) {
+			ResizeNodes(0);
+			globalBoundDiag = 0;
+			return true;
+		}
+		float cost = EditedTreeCost(rootID);
+		if (builtTreeCost < 0) builtTreeCost = cost;	// a tree that was only ever edited
+		ReorderNodes(rootID, Stochastic());
+		refitOrder.clear();
+		nodeParents.clear();
+		lightLeaves.clear();
+		globalBoundDiag = traversalNodes[0].boundBox.diagonal_length();
+		if (!wideNodes.empty()) BuildWideNodes();
+		return cost <= builtTreeCost * LIGHTCUTS_REFIT_MAX_COST_RATIO;
+	}
+
+	// TreeCost of the tree under edit
+	float EditedTreeCost(int rootID) const
+	{
+		float rootDiag2 = traversalNodes[rootID].boundBox.WidthSquared();
+		float rootIntensity = SumVal(nodeColors[rootID]);
+		if (rootDiag2 <= 0 || rootIntensity <= 0) return 0;
+		return float(editTreeCost / (rootDiag2 * rootIntensity));
+	}
+
+	// Appends a node for Insert, which is laid out with the others by EndEdit
+	int AddEditNode()
+	{
+		BuildWorkspace &workspace = Workspace();
+		int nodeID = GetNumOfNodes();
+		traversalNodes.emplace_back();
+		nodeColors.emplace_back();
+		if (UseCones) nodeCones.emplace_back();
+		workspace.parents.push_back(-1);
+		workspace.subtreeSizes.push_back(1);
+		return nodeID;
+	}
+
+	void ReplaceChild(int nodeID, int oldChild, int newChild)
+	{
+		TraversalNode &node = traversalNodes[nodeID];
+		if (node.primaryChild == oldChild) node.primaryChild = newChild;
+		else node.secondaryChild = newChild;
+	}
+
+	// Recomputes the nodes from nodeID up to the root from their children.
+	// The representative light of a node stays the one of its primary child.
+	void RepairPath(int nodeID)
+	{
+		BuildWorkspace &workspace = Workspace();
+		for (; nodeID >= 0; nodeID = workspace.parents[nodeID]) {
+			editTreeCost -= NodeCost(nodeID);
+			TraversalNode &node = traversalNodes[nodeID];
+			TraversalNode const &node0 = traversalNodes[node.primaryChild];
+			TraversalNode const &node1 = traversalNodes[node.secondaryChild];
+			node.boundBox = NodeBound(node0.boundBox, node1.boundBox);
+			node.lightID = node0.lightID;
+			nodeColors[nodeID] = nodeColors[node.primaryChild] + nodeColors[node.secondaryChild];
+			if (UseCones) nodeCones[nodeID] = MergeCones(nodeCones[node.primaryChild], nodeCones[node.secondaryChild]);
+			MergeProb(node, node0, node1, Stochastic());
+			workspace.subtreeSizes[nodeID] = workspace.subtreeSizes[node.primaryChild] + workspace.subtreeSizes[node.secondaryChild] + 1;
+			editTreeCost += NodeCost(nodeID);
+		}
+	}
+
+	// The merge weight of a single cluster, so that the growth of a cluster can be compared with MergeWeight
+	float ClusterWeight(int nodeID, float globalBoundDiag2) const
+	{
+		aabb const &boundBox = traversalNodes[nodeID].boundBox;
+		float diag2 = dot(boundBox.end - boundBox.pos, boundBox.end - boundBox.pos);
+		if (UseCones) {
+			float coneAngleWeight = 1.0f - cosf(nodeCones[nodeID].w);
+			diag2 += coneAngleWeight * coneAngleWeight * globalBoundDiag2;
+		}
+		return diag2 * SumVal(nodeColors[nodeID]);
+	}
+
+	// Finds the node that the new leaf is merged with, the one that adds the least weight to the tree: the merged node
+	// plus the growth of its ancestors. The subtrees are searched in the order of the growth of their ancestors and
+	// skipped once it exceeds the best merge, which gives the optimal node (Bittner et al. 2015).
+	int FindInsertionSibling(int rootID, int leafID, float globalBoundDiag2)
+	{
+		std::vector<InsertionCandidate> &queue = Workspace().insertionQueue;
+		queue.clear();
+		queue.push_back({ rootID, 0.f });
+		float leafWeight = ClusterWeight(leafID, globalBoundDiag2);
+		int bestID = rootID;
+		float bestCost = FLT_MAX;
+		while (!queue.empty()) {
+			std::pop_heap(queue.begin(), queue.end());
+			InsertionCandidate candidate = queue.back();
+			queue.pop_back();
+			if (candidate.inheritedCost + leafWeight >= bestCost) break;
+
+			float merged = MergeWeight(candidate.nodeID, leafID, globalBoundDiag2);
+			float cost = candidate.inheritedCost + merged;
+			if (cost < bestCost) {
+				bestID = candidate.nodeID;
+				bestCost = cost;
+			}
+			TraversalNode const &node = traversalNodes[candidate.nodeID];
+			float inheritedCost = cost - ClusterWeight(candidate.nodeID, globalBoundDiag2);
+			if (node.primaryChild >= 0 && inheritedCost + leafWeight < bestCost) {
+				queue.push_back({ node.primaryChild, inheritedCost });
+				std::push_heap(queue.begin(), queue.end());
+				queue.push_back({ node.secondaryChild, inheritedCost });
+				std::push_heap(queue.begin(), queue.end());
+			}
+		}
+		return bestID;
+	}
+
+	void ResizeNodes(int numNodes)
+	{
+		refitOrder.clear();
+		builtTreeCost = -1;
+		nodeParents.clear();
+		lightLeaves.clear();
+		wideNodes.clear();
+		wideSlots.clear();
+		traversalNodes.clear();
+		traversalNodes.resize(numNodes);
+		nodeColors.clear();
+		nodeColors.resize(numNodes);
+		if (UseCones) {
+			nodeCones.clear();
+			nodeCones.resize(numNodes);
+		}
+		if (RepLights::value) {
+			int numInternalNodes = numNodes / 2;
+			repLights.resize(numInternalNodes * SamplingPolicy::repCount);
+			repLightCDFs.resize(numInternalNodes * SamplingPolicy::repCount);
+			repLightCounts.assign(numNodes, 0);
+		}
+	}
+
+	static float MaxVal(const CPUColor  &c) { return c.r > c.g ? (c.r > c.b ? c.r : c.b) : (c.g > c.b ? c.g : c.b); }
+	static float SumVal(const CPUColor  &c) { return c.r + c.g + c.b; }
+
+	template <typename T> static void Swap(T &a, T &b) { T t = a; a = b; b = t; }
+
+	static aabb NodeBound(const aabb &box0, const aabb &box1)
+	{
+		glm::vec3 boundMin = box0.pos;
+		if (boundMin.x > box1.pos.x) boundMin.x = box1.pos.x;
+		if (boundMin.y > box1.pos.y) boundMin.y = box1.pos.y;
+		if (boundMin.z > box1.pos.z) boundMin.z = box1.pos.z;
+		glm::vec3 boundMax = box0.end;
+		if (boundMax.x < box1.end.x) boundMax.x = box1.end.x;
+		if (boundMax.y < box1.end.y) boundMax.y = box1.end.y;
+		if (boundMax.z < box1.end.z) boundMax.z = box1.end.z;
+		return aabb(boundMin, boundMax);
+	}
+
+	// Merge weight of two clusters: the squared diagonal of the merged bounds (plus the cone term) times the total intensity
+	float MergeWeight(int node0, int node1, float globalBoundDiag2) const
+	{
+		float intensity0 = SumVal(nodeColors[node0]);
+		float intensity1 = SumVal(nodeColors[node1]);
+		float intensity = intensity0 + intensity1;
+		aabb  boundBox = NodeBound(traversalNodes[node0].boundBox, traversalNodes[node1].boundBox);
+		float diag2 = dot(boundBox.end - boundBox.pos, boundBox.end - boundBox.pos);
+		if (UseCones) {
+			glm::vec4 boundingCone = MergeCones(nodeCones[node0], nodeCones[node1]);
+			float coneAngleWeight = 1.0f - cosf(boundingCone.w);
+			diag2 += coneAngleWeight * coneAngleWeight * globalBoundDiag2;
+		}
+		return diag2 * intensity;
+	}
+
+	// Creates the internal node nodeID from the two given nodes and picks its representative light in proportion to their
+	// intensities, with BuildRandom of the build seed and nodeID, so the pick does not depend on the order of the merges.
+	// Returns true if the representative light comes from the first node.
+	bool MergeNodes(int nodeID, int child0, int child1)
+	{
+		TraversalNode const &node0 = traversalNodes[child0];
+		TraversalNode const &node1 = traversalNodes[child1];
+		TraversalNode &node = traversalNodes[nodeID];
+		nodeColors[nodeID] = nodeColors[child0] + nodeColors[child1];
+		node.boundBox = NodeBound(node0.boundBox, node1.boundBox);
+		if (UseCones) nodeCones[nodeID] = MergeCones(nodeCones[child0], nodeCones[child1]);
+		// pick the position randomly
+		float intensity0 = SumVal(nodeColors[child0]);
+		float intensity1 = SumVal(nodeColors[child1]);
+		float intensity = intensity0 + intensity1;
+		bool pickFirst = BuildRandom(buildSeed, nodeID) * intensity < intensity0;
+		node.lightID = pickFirst ? node0.lightID : node1.lightID;
+		node.primaryChild = pickFirst ? child0 : child1;
+		node.secondaryChild = pickFirst ? child1 : child0;
+		MergeProb(node, node0, node1, Stochastic());
+		std::vector<int> &subtreeSizes = Workspace().subtreeSizes;
+		subtreeSizes[nodeID] = subtreeSizes[child0] + subtreeSizes[child1] + 1;
+		return pickFirst;
+	}
+
+	template <typename LightPosFunc>
+	void BuildHeap(int numLights, LightPosFunc lightPosFunc, float globalBoundDiag2)
+	{
+		// Create a point cloud of light positions. Merged lights are removed from it, so the searches
+		// never return a light that has already been used.
+		BuildWorkspace &workspace = Workspace();
+		DynamicPointCloud &pointCloud = workspace.pointCloud;
+		pointCloud.Build(numLights, lightPosFunc);
+
+		// Create an array of closest light id and its weight
+		std::vector<ClosestLight> &closestLights = workspace.closestLights;
+		closestLights.resize(numLights);
+
+		// For each light, search the point cloud and find the closest light.
+		// The lights are searched in batches along a Morton curve, and each search is bounded by the distance
+		// to the previous light of the batch and to its closest light, which are both close to the current one.
+		std::vector<uint64_t> &mortonKeys = workspace.mortonKeys;
+		MortonOrder(numLights, lightPosFunc, mortonKeys);
+		const int batchSize = 256;
+		concurrency::parallel_for(0, (numLights + batchSize - 1) / batchSize, [&](int batch)
+		{
+			int start = batch * batchSize;
+			int end = std::min(numLights, start + batchSize);
+			int prevLightID = -1;
+			for (int k = start; k < end; k++) {
+				int i = int(mortonKeys[k] & 0xFFFFFFFF);
+				glm::vec3 position = lightPosFunc(i);
+				float maxDistanceSquared = FLT_MAX;
+				if (prevLightID >= 0) {
+					glm::vec3 d = lightPosFunc(prevLightID) - position;
+					maxDistanceSquared = glm::dot(d, d);
+					int prevClosestID = closestLights[prevLightID].id;	// written by this batch
+					if (prevClosestID != i) {
+						d = lightPosFunc(prevClosestID) - position;
+						maxDistanceSquared = std::min(maxDistanceSquared, glm::dot(d, d));
+					}
+				}
+				int closestLightID;
+				float distanceSquaredToClosestLight;
+				pointCloud.GetClosest(position, i, closestLightID, distanceSquaredToClosestLight, maxDistanceSquared);
+				assert(closestLightID >= 0);
+
+				// The closest light is found, we must compute the weight
+				float intensity0 = SumVal(nodeColors[i + numLights - 1]);
+				float intensity1 = SumVal(nodeColors[closestLightID + numLights - 1]);
+				float intensity = intensity0 + intensity1;
+				if (UseCones) {
+					glm::vec4 boundingCone = MergeCones(nodeCones[i + numLights - 1], nodeCones[closestLightID + numLights - 1]);
+					float coneAngleWeight = 1.0f - cosf(boundingCone.w);
+					distanceSquaredToClosestLight += coneAngleWeight * coneAngleWeight * globalBoundDiag2;
+				}
+				closestLights[i].id = closestLightID;
+				closestLights[i].weight = distanceSquaredToClosestLight * intensity;
+				prevLightID = i;
+			}
+		});
+
+		// Build a heap for the closest light distances, so we can quickly find the closest pair
+		BuilderHeap heap(workspace.heap, closestLights, numLights);
+
+		// Create an array of light indices
+		std::vector<int> &nodeIndex = workspace.nodeIndex;
+		nodeIndex.resize(numLights);
+		for (int i = 0; i < numLights; i++) nodeIndex[i] = i + numLights - 1;
+
+		// Take the elements from the heap one by one
+		int nextNodeIndex = numLights - 2;
+		while (nextNodeIndex >= 0) {
+			// Check if the light has already been used
+			int thisLightID = heap.Head().lightID;
+			if (nodeIndex[thisLightID] < 0) {
+				// The light has already been used, skip
+				heap.Head().weight = LIGHTCUTS_BIGFLOAT;
+				heap.MoveHeadDown();
+			}
+			else {
+				// Check if its pair has already been used
+				int closestLightID = heap.Head().closestLightID;
+				if (nodeIndex[closestLightID] < 0) {
+					// The closest one has already been used,
+					// we must find another one
+					float distanceSquaredToClosestLight;
+					pointCloud.GetClosest(lightPosFunc(thisLightID), thisLightID, closestLightID, distanceSquaredToClosestLight);
+					assert(closestLightID >= 0);
+					// The new closest light is found, we must recompute the weight
+					float weight = MergeWeight(nodeIndex[thisLightID], nodeIndex[closestLightID], globalBoundDiag2);
+					heap.Head().closestLightID = closestLightID;
+					heap.Head().weight = weight;
+					heap.MoveHeadDown();
+				}
+				else {
+					// The light is in the heap, so we can merge with it
+					if (MergeNodes(nextNodeIndex, nodeIndex[thisLightID], nodeIndex[closestLightID])) {
+						// picked the first light
+						nodeIndex[closestLightID] = -1; // removed from consideration
+						nodeIndex[thisLightID] = nextNodeIndex;
+						pointCloud.Remove(closestLightID);
+					}
+					else {
+						// picked the second light
+						nodeIndex[thisLightID] = -1; // removed from consideration
+						nodeIndex[closestLightID] = nextNodeIndex;
+						pointCloud.Remove(thisLightID);
+					}
+					nextNodeIndex--;
+				}
+			}
+		}
+	}
+
+	// Nearest-neighbour chain clustering: follows the chain of nearest clusters until two clusters are the nearest
+	// of each other, and merges them. It uses the merge weight of the heap builder, but never revisits stale pairs.
+	// Each cluster is represented by the position of its representative light, which must be inside its bounds.
+	template <typename LightPosFunc>
+	void BuildNNChain(int numLights, LightPosFunc lightPosFunc, float globalBoundDiag2)
+	{
+		// Merged lights are removed from the point cloud, as in the heap builder
+		BuildWorkspace &workspace = Workspace();
+		DynamicPointCloud &pointCloud = workspace.pointCloud;
+		pointCloud.Build(numLights, lightPosFunc);
+
+		std::vector<int> &nodeIndex = workspace.nodeIndex;
+		nodeIndex.resize(numLights);
+		for (int i = 0; i < numLights; i++) nodeIndex[i] = i + numLights - 1;
+
+		std::vector<int> &chain = workspace.chain;
+		std::vector<char> &inChain = workspace.inChain;
+		chain.clear();
+		inChain.assign(numLights, 0);
+
+		int chainStart = 0;
+		int nextNodeIndex = numLights - 2;
+		while (nextNodeIndex >= 0) {
+			if (chain.empty()) {
+				while (nodeIndex[chainStart] < 0) chainStart++;
+				chain.push_back(chainStart);
+				inChain[chainStart] = 1;
+			}
+			int thisLightID = chain.back();
+			int prevLightID = chain.size() > 1 ? chain[chain.size() - 2] : -1;
+			int closestLightID = NearestByWeight(pointCloud, lightPosFunc, thisLightID, prevLightID, globalBoundDiag2);
+
+			if (!inChain[closestLightID]) {
+				chain.push_back(closestLightID);
+				inChain[closestLightID] = 1;
+				continue;
+			}
+
+			// The two lights are the nearest of each other, or the chain has come back to an earlier light
+			// because the weights do not decrease along every path. Either way merge the end of the chain with
+			// the earlier light it points back to, and drop the part of the chain from that light up.
+			int chainLightID;
+			do {
+				chainLightID = chain.back();
+				chain.pop_back();
+				inChain[chainLightID] = 0;
+			} while (chainLightID != closestLightID);
+			if (MergeNodes(nextNodeIndex, nodeIndex[thisLightID], nodeIndex[closestLightID])) {
+				// picked the first light
+				nodeIndex[closestLightID] = -1; // removed from consideration
+				nodeIndex[thisLightID] = nextNodeIndex;
+				pointCloud.Remove(closestLightID);
+			}
+			else {
+				// picked the second light
+				nodeIndex[thisLightID] = -1; // removed from consideration
+				nodeIndex[closestLightID] = nextNodeIndex;
+				pointCloud.Remove(thisLightID);
+			}
+			nextNodeIndex--;
+		}
+	}
+
+	// Returns the light with the lowest merge weight with the cluster of the given light, among the previous light
+	// of the chain and the live lights within LIGHTCUTS_NN_CHAIN_SEARCH_SCALE times the distance to the closest one.
+	// On a tie the previous light wins, then the lower light index.
+	template <typename LightPosFunc>
+	int NearestByWeight(const DynamicPointCloud &pointCloud, LightPosFunc &lightPosFunc, int lightID, int prevLightID, float globalBoundDiag2)
+	{
+		const std::vector<int> &nodeIndex = Workspace().nodeIndex;
+		int nodeID = nodeIndex[lightID];
+		float intensity = SumVal(nodeColors[nodeID]);
+		int best = prevLightID;
+		float bestWeight = prevLightID >= 0 ? SymmetricMergeWeight(nodeID, nodeIndex[prevLightID], globalBoundDiag2) : LIGHTCUTS_BIGFLOAT;
+
+		// one search that shrinks with the closest light found so far; the nearer branches are visited first, so the closest
+		// light comes early. The lights are only compared once the search is done, against the final radius, so that a light
+		// that was within the radius early on cannot win on its cone from outside of it.
+		std::vector<ClosestLight> &candidates = Workspace().chainCandidates;
+		candidates.clear();
+		const float searchScale2 = LIGHTCUTS_NN_CHAIN_SEARCH_SCALE * LIGHTCUTS_NN_CHAIN_SEARCH_SCALE;
+		float closestDistanceSquared = FLT_MAX;
+		float maxDistanceSquared = FLT_MAX;
+		pointCloud.ForEachWithin(lightPosFunc(lightID), lightID, maxDistanceSquared, [&](int index, float distanceSquared)
+		{
+			candidates.push_back({ index, distanceSquared });
+			closestDistanceSquared = std::min(closestDistanceSquared, distanceSquared);
+			maxDistanceSquared = std::min(FLT_MAX, closestDistanceSquared * searchScale2);
+		});
+
+		for (const ClosestLight &candidate : candidates) {
+			int index = candidate.id;
+			if (candidate.weight > maxDistanceSquared || index == best) continue;
+			// the merged bounds contain both lights, so the weight is at least the squared distance times the intensity
+			if (intensity > 0 && best >= 0 && candidate.weight * intensity > bestWeight) continue;
+			float weight = SymmetricMergeWeight(nodeID, nodeIndex[index], globalBoundDiag2);
+			if (best < 0 || weight < bestWeight || (weight == bestWeight && best != prevLightID && index < best)) {
+				best = index;
+				bestWeight = weight;
+			}
+		}
+		assert(best >= 0);
+		return best;
+	}
+
+	// MergeWeight with the lower node first, so that it does not depend on the order of the nodes
+	float SymmetricMergeWeight(int node0, int node1, float globalBoundDiag2) const
+	{
+		return node0 < node1 ? MergeWeight(node0, node1, globalBoundDiag2) : MergeWeight(node1, node0, globalBoundDiag2);
+	}
+
+	// Sorts the lights along a Morton curve of their positions. The light index is in the lower 32 bits of the keys.
+	template <typename LightPosFunc>
+	static void MortonOrder(int numLights, LightPosFunc &lightPosFunc, std::vector<uint64_t> &mortonKeys)
+	{
+		aabb centerBound;
+		for (int i = 0; i < numLights; i++) centerBound.Union(lightPosFunc(i));
+		glm::vec3 centerExtent = centerBound.dimension();
+		for (int j = 0; j < 3; j++) if (centerExtent[j] <= 0) centerExtent[j] = 1;
+
+		mortonKeys.resize(numLights);
+		concurrency::parallel_for(0, numLights, [&](int i)
+		{
+			const unsigned quantLevel = 1024;
+			glm::vec3 normPos = (lightPosFunc(i) - centerBound.pos) / centerExtent;
+			unsigned quantX = BitExpansion(std::min(unsigned(std::max(0.f, normPos.x) * quantLevel), quantLevel - 1));
+			unsigned quantY = BitExpansion(std::min(unsigned(std::max(0.f, normPos.y) * quantLevel), quantLevel - 1));
+			unsigned quantZ = BitExpansion(std::min(unsigned(std::max(0.f, normPos.z) * quantLevel), quantLevel - 1));
+			uint64_t mortonCode = quantX * 4 + quantY * 2 + quantZ;
+			mortonKeys[i] = (mortonCode << 32) | uint64_t(i);
+		});
+		concurrency::parallel_sort(mortonKeys.begin(), mortonKeys.end());
+	}
+
+	// Locally-ordered agglomerative clustering: the clusters are kept along a Morton curve and each cluster
+	// searches for its best merge partner within a small window. All mutually-nearest pairs are merged in the
+	// same round, so the search and the merges run in parallel.
+	template <typename LightPosFunc>
+	void BuildLocallyOrdered(int numLights, LightPosFunc lightPosFunc, float globalBoundDiag2)
+	{
+		// Sort the leaves along a Morton curve
+		BuildWorkspace &workspace = Workspace();
+		std::vector<uint64_t> &mortonKeys = workspace.mortonKeys;
+		MortonOrder(numLights, lightPosFunc, mortonKeys);
+
+		std::vector<int> &clusters = workspace.clusters;
+		clusters.resize(numLights);
+		for (int i = 0; i < numLights; i++) clusters[i] = int(mortonKeys[i] & 0xFFFFFFFF) + numLights - 1;
+
+		std::vector<int> &nearest = workspace.nearest;
+		std::vector<int> &mergeOffset = workspace.mergeOffset;
+		nearest.resize(numLights);
+		mergeOffset.resize(numLights + 1);
+
+		int nextNodeIndex = numLights - 2;
+		while (clusters.size() > 1) {
+			int numClusters = (int)clusters.size();
+
+			// Find the best merge partner of each cluster within the window.
+			// The weight is evaluated with the lower cluster first, so that it is symmetric.
+			concurrency::parallel_for(0, numClusters, [&](int i)
+			{
+				int jStart = std::max(0, i - LIGHTCUTS_LOCALLY_ORDERED_RADIUS);
+				int jEnd = std::min(numClusters - 1, i + LIGHTCUTS_LOCALLY_ORDERED_RADIUS);
+				int best = -1;
+				float bestWeight = LIGHTCUTS_BIGFLOAT;
+				for (int j = jStart; j <= jEnd; j++) {
+					if (j == i) continue;
+					float weight = i < j ? MergeWeight(clusters[i], clusters[j], globalBoundDiag2) :
+						MergeWeight(clusters[j], clusters[i], globalBoundDiag2);
+					if (best < 0 || weight < bestWeight) {
+						best = j;
+						bestWeight = weight;
 					}
-# else
-					nid = (nodes[c1].probStart <= r) ? c1 : c0;
-# endif
-				}
-				hd.sampledNodeID = nid;
-				id = hd.sampledNodeID;
-# ifdef LIGHTCUTS_HIERARCHICAL
-				hd.one_over_prob = nprob == 0.f ? 0.f : 1.0f / nprob;
-# endif
-			}
-#endif
-			int lightID = nodes[id].lightID;
-#ifdef LIGHTCUTS_REP_COUNT
-			if (nodes[nodeID].nodeLights.size() > 0) {
-				float r = nrandom();
-				size_t i = 0;
-				for (; i < nodes[nodeID].nodeLights.size() - 1; ++i) {
-					if (r <= nodes[nodeID].nodeLightCDF[i]) break;
 				}
-				lightID = nodes[nodeID].nodeLights[i];
+				nearest[i] = best;
+			});
+
+			// Count the mutually-nearest pairs; the merged cluster takes the slot of the lower one
+			mergeOffset[0] = 0;
+			for (int i = 0; i < numClusters; i++) {
+				bool merges = nearest[i] > i && nearest[nearest[i]] == i;
+				mergeOffset[i + 1] = mergeOffset[i] + (merges ? 1 : 0);
 			}
-			hd.sampledLightID = lightID;
-#endif
-			hd.nodeID = nodeID;
-#ifdef LIGHTCUTS_HIERARCHICAL
-			hd.atten = deadBranch ? CPUColor(0, 0, 0) : attenFunc(lightID, hd);
-			CPUColor nodeColor = lightType == LightType::POINT ? nodes[id].color : 1.f;
-			hd.color = hd.one_over_prob * nodeColor * hd.atten;
+			int numMerges = mergeOffset[numClusters];
+			assert(numMerges > 0);
 
-#else
-			hd.atten = attenFunc(lightID, hd);
-			CPUColor nodeColor = lightType == LightType::POINT ? nodes[nodeID].color : 1.f;
-			hd.color = nodeColor * hd.atten;
-#endif
-			hd.error = errorFunction(p, N, nodes[nodeID]);
+			concurrency::parallel_for(0, numClusters, [&](int i)
+			{
+				if (mergeOffset[i + 1] == mergeOffset[i]) return;
+				int k = mergeOffset[i];
+				int j = nearest[i];
+				int nodeID = nextNodeIndex - k;
+				MergeNodes(nodeID, clusters[i], clusters[j]);
+				clusters[i] = nodeID;
+				clusters[j] = -1; // removed from consideration
+			});
+			nextNodeIndex -= numMerges;
+
+			clusters.erase(std::remove(clusters.begin(), clusters.end(), -1), clusters.end());
+		}
+		assert(nextNodeIndex == -1);
+	}
 
-			return true;
-		};
+	// Top-down clustering: the lights of each node are split with the binned surface area orientation heuristic
+	// (Conty Estevez and Kulla 2018) and the two halves are built in parallel. The internal nodes of a subtree
+	// with m lights take the m-1 indices starting at its root, so parents still precede their children.
+	template <typename LightPosFunc>
+	void BuildTopDown(int numLights, LightPosFunc lightPosFunc)
+	{
+		if (numLights < 2) return;
+		BuildWorkspace &workspace = Workspace();
+		std::vector<glm::vec3> &lightPositions = workspace.lightPositions;
+		lightPositions.resize(numLights);
+		concurrency::parallel_for(0, numLights, [&](int i) { lightPositions[i] = lightPosFunc(i); });
+		std::vector<int> &lightIDs = workspace.lightIDs;
+		lightIDs.resize(numLights);
+		for (int i = 0; i < numLights; i++) lightIDs[i] = i;
+
+		SplitSAOH(lightIDs.data(), numLights, 0, numLights, lightPositions);
+	}
+
+	// Splits the given lights under node nodeID and returns the index of the node that holds them.
+	// The nodes are merged on the way back up, as soon as both of their children are complete.
+	int SplitSAOH(int *lightIDs, int count, int nodeID, int numLights, const std::vector<glm::vec3> &lightPositions)
+	{
+		if (count == 1) return lightIDs[0] + numLights - 1;
 
-		auto heapSwapItems = [&heap](int parent, int child)
+		struct SAOHBin
 		{
-			HeapDataType p = heap[parent];
-			heap[parent] = heap[child];
-			heap[child] = p;
+			aabb      bound;
+			float     energy = 0;
+			int       count = 0;
+			glm::vec4 cone;
+			void Add(aabb &otherBound, float otherEnergy, int otherCount, const glm::vec4 &otherCone)
+			{
+				if (otherCount == 0) return;
+				bound.Union(otherBound);
+				if (UseCones) cone = count == 0 ? otherCone : MergeCones(cone, otherCone);
+				energy += otherEnergy;
+				count += otherCount;
+			}
+			float Cost()
+			{
+				float cost = energy * bound.SA();
+				if (UseCones) cost *= OrientationMeasure(cone);
+				return cost;
+			}
 		};
+		aabb centerBound, bound;
+		for (int i = 0; i < count; i++) {
+			centerBound.Union(lightPositions[lightIDs[i]]);
+			bound.Union(traversalNodes[lightIDs[i] + numLights - 1].boundBox);
+		}
+		glm::vec3 centerExtent = centerBound.dimension();
+		glm::vec3 extent = bound.dimension();
+		float maxExtent = std::max(extent.x, std::max(extent.y, extent.z));
 
-		auto heapMoveUp = [&heapSwapItems, &heap](int numLights)
+		auto binIndex = [&](int lightID, int axis)
 		{
-			int ix = numLights;
-			while (ix >= 2) {
-				int parent = ix / 2;
-				if (heap[parent].error >= heap[ix].error) break;
-				heapSwapItems(parent, ix);
-				ix = parent;
-			}
+			float t = (lightPositions[lightID][axis] - centerBound.pos[axis]) / centerExtent[axis];
+			return std::min(int(t * LIGHTCUTS_SAOH_BINS), LIGHTCUTS_SAOH_BINS - 1);
 		};
 
-		auto heapMoveDown = [&heapSwapItems, &heap](int ix, int numLights)
+		// Find the cheapest split of each axis
+		float axisCost[3];
+		int axisSplit[3];
+		auto evalAxis = [&](int axis)
 		{
-			int child = ix * 2;
-			while (child + 1 <= numLights) {
-				if (heap[child].error < heap[child + 1].error) child++;
-				if (heap[ix].error >= heap[child].error) return;
-				heapSwapItems(ix, child);
-				ix = child;
-				child = ix * 2;
+			axisCost[axis] = LIGHTCUTS_BIGFLOAT;
+			axisSplit[axis] = -1;
+			if (centerExtent[axis] <= 0) return;
+			SAOHBin bins[LIGHTCUTS_SAOH_BINS];
+			for (int i = 0; i < count; i++) {
+				int leafID = lightIDs[i] + numLights - 1;
+				glm::vec4 cone = UseCones ? nodeCones[leafID] : glm::vec4(0);
+				bins[binIndex(lightIDs[i], axis)].Add(traversalNodes[leafID].boundBox, SumVal(nodeColors[leafID]), 1, cone);
 			}
-			if (child <= numLights) {
-				if (heap[ix].error < heap[child].error) {
-					heapSwapItems(ix, child);
+			// sweep from the right, then evaluate the splits from the left
+			float rightCost[LIGHTCUTS_SAOH_BINS];
+			SAOHBin right;
+			for (int b = LIGHTCUTS_SAOH_BINS - 1; b > 0; b--) {
+				right.Add(bins[b].bound, bins[b].energy, bins[b].count, bins[b].cone);
+				rightCost[b] = right.count > 0 ? right.Cost() : -1;
+			}
+			// the regularity factor prefers splitting across the longest side
+			float kr = extent[axis] > 0 ? maxExtent / extent[axis] : 1;
+			SAOHBin left;
+			for (int b = 0; b < LIGHTCUTS_SAOH_BINS - 1; b++) {
+				left.Add(bins[b].bound, bins[b].energy, bins[b].count, bins[b].cone);
+				if (left.count == 0 || rightCost[b + 1] < 0) continue;
+				float cost = kr * (left.Cost() + rightCost[b + 1]);
+				if (cost < axisCost[axis]) {
+					axisCost[axis] = cost;
+					axisSplit[axis] = b + 1;
 				}
 			}
 		};
+		const int parallelThreshold = 4096;
+		if (count > parallelThreshold) concurrency::parallel_for(0, 3, evalAxis);
+		else for (int axis = 0; axis < 3; axis++) evalAxis(axis);
+
+		int splitAxis = 0;
+		if (axisCost[1] < axisCost[splitAxis]) splitAxis = 1;
+		if (axisCost[2] < axisCost[splitAxis]) splitAxis = 2;
+
+		int leftCount = count / 2;	// the lights cannot be separated by their positions, split them in the middle
+		if (axisSplit[splitAxis] >= 0) {
+			int *mid = std::partition(lightIDs, lightIDs + count, [&](int lightID) { return binIndex(lightID, splitAxis) < axisSplit[splitAxis]; });
+			leftCount = int(mid - lightIDs);
+		}
+		assert(leftCount > 0 && leftCount < count);
+
+		// the left subtree takes the internal nodes [nodeID + 1, nodeID + leftCount - 1]
+		int leftNodeID = nodeID + 1;
+		int rightNodeID = nodeID + leftCount;
+		int child0, child1;
+		if (count > parallelThreshold) {
+			concurrency::parallel_invoke(
+				[&] { child0 = SplitSAOH(lightIDs, leftCount, leftNodeID, numLights, lightPositions); },
+				[&] { child1 = SplitSAOH(lightIDs + leftCount, count - leftCount, rightNodeID, numLights, lightPositions); }
+			);
+		}
+		else {
+			child0 = SplitSAOH(lightIDs, leftCount, leftNodeID, numLights, lightPositions);
+			child1 = SplitSAOH(lightIDs + leftCount, count - leftCount, rightNodeID, numLights, lightPositions);
+		}
+		MergeNodes(nodeID, child0, child1);
+		return nodeID;
+	}
 
-		int numLights = 0;
-		CPUColor color(0, 0, 0);
-
-		if (computeNode(heap[1], 0)) {
-			numLights = 1;
-			color = heap[1].color;
-			float colorIntens = GetColorIntensity(color);
-
-			while (heap[1].error > (errorLimit * colorIntens) && numLights < heapArraySize - 1) {
-				int id = 1;
-				int nodeID = heap[id].nodeID;
-				int pChild = nodes[nodeID].primaryChild;
-				int sChild = nodes[nodeID].secondaryChild;
-				assert(pChild >= 0);
-				color = color - heap[id].color;
-
-#ifdef LIGHTCUTS_STOCHASTIC
-				if (heap[id].sampledNodeID >= sChild) Swap(pChild, sChild);
-#elif defined(LIGHTCUTS_REP_COUNT)
-				if (nodes[sChild].nodeLights.size() > 0) {
-					for (int lightID : nodes[sChild].nodeLights) {
-						if (lightID == heap[id].sampledLightID) {
-							Swap(pChild, sChild);
-							break;
-						}
-					}
-				}
-				else {
-					if (nodes[sChild].lightID == heap[id].sampledLightID) Swap(pChild, sChild);
-				}
-#endif
-#ifdef LIGHTCUTS_HIERARCHICAL
-				float prob0;
-				bool liveBranch = firstChildWeight(prob0, pChild, sChild);
-				assert(liveBranch);	// we should not have a dead node in the heap
+	static float GetColorIntensity(const CPUColor &color)
+	{
+		float intens = SumVal(color) / 3.0f;
+		if (intens < LIGHTCUTS_MIN_INTENSITY) intens = LIGHTCUTS_MIN_INTENSITY;
+		return intens;
+	}
 
-				heap[id].one_over_prob *= prob0;
-				CPUColor nodeColor = lightType == LightType::POINT ? nodes[heap[id].sampledNodeID].color : 1.f;
-				heap[id].color = heap[id].one_over_prob * nodeColor * heap[id].atten;
+	//-------------------------------------------------------------------------------
+	// The parts that depend on the policies. Each is overloaded on a policy or on one of the switches above,
+	// and only the overloads of the selected policies are instantiated.
 
-#else
-				CPUColor nodeColor = lightType == LightType::POINT ? nodes[pChild].color : 1.f;
-				heap[id].color = nodeColor * heap[id].atten;
-#endif
-				heap[id].nodeID = pChild;
-				heap[id].error = errorFunction(p, N, nodes[pChild]);
-				color = color + heap[id].color;
-				heapMoveDown(id, numLights);
-				HeapDataType &child_hd = heap[numLights + 1];
-				if (computeNode(child_hd, sChild)) {
-					numLights++;
-					color = color + child_hd.color;
-					heapMoveUp(numLights);
+	template <typename HeapDataType>
+	static void HeapMoveUp(HeapDataType *heap, int numLights)
+	{
+		int ix = numLights;
+		while (ix >= 2) {
+			int parent = ix / 2;
+			if (heap[parent].error >= heap[ix].error) break;
+			Swap(heap[parent], heap[ix]);
+			ix = parent;
+		}
+	}
+
+	template <typename HeapDataType>
+	static void HeapMoveDown(HeapDataType *heap, int ix, int numLights)
+	{
+		int child = ix * 2;
+		while (child + 1 <= numLights) {
+			if (heap[child].error < heap[child + 1].error) child++;
+			if (heap[ix].error >= heap[child].error) return;
+			Swap(heap[ix], heap[child]);
+			ix = child;
+			child = ix * 2;
+		}
+		if (child <= numLights) {
+			if (heap[ix].error < heap[child].error) {
+				Swap(heap[ix], heap[child]);
+			}
+		}
+	}
+
+	template <typename ErrorFunc>
+	float NodeError(const ShadingFrame &frame, int nodeID, ErrorFunc &errorFunc) const
+	{
+		TraversalNode const &node = traversalNodes[nodeID];
+		if (node.primaryChild < 0) return 0.0f;
+		else return errorFunc(frame.p, frame.N, node.lightID, nodeColors[nodeID], node.boundBox);
+	}
+
+	// Returns true if the node with the largest error in the cut should be refined
+	template <typename HeapDataType>
+	static bool CanRefine(const HeapDataType *heap, int heapArraySize, int numLights, const CPUColor &color, float errorLimit)
+	{
+		return heap[1].error > (errorLimit * GetColorIntensity(color)) && numLights < heapArraySize - 1;
+	}
+
+	// Replaces the node with the largest error in the cut by its children
+	template <typename HeapDataType, typename AttenFunc, typename ErrorFunc, typename RandFunc>
+	void RefineCut(HeapDataType *heap, int &numLights, CPUColor &color, const ShadingFrame &frame,
+		AttenFunc &attenFunc, ErrorFunc &errorFunc, RandFunc &nrandom) const
+	{
+		int nodeID = heap[1].nodeID;
+		int pChild = traversalNodes[nodeID].primaryChild;
+		int sChild = traversalNodes[nodeID].secondaryChild;
+		assert(pChild >= 0);
+		color = color - heap[1].color;
+
+		// the sample of the node stays with the child that it came from
+		SplitSample(heap[1], pChild, sChild, frame, SamplingPolicy());
+		SetCutNode(heap, numLights, color, pChild, frame, errorFunc);
+		HeapDataType &child_hd = heap[numLights + 1];
+		SampleNode(child_hd, sChild, frame, attenFunc, nrandom, SamplingPolicy());
+		child_hd.error = NodeError(frame, sChild, errorFunc);
+		AddCutNode(heap, numLights, color);
+	}
+
+	// Moves the split node with the largest error to its child that keeps its sample
+	template <typename HeapDataType, typename ErrorFunc>
+	void SetCutNode(HeapDataType *heap, int numLights, CPUColor &color, int pChild, const ShadingFrame &frame, ErrorFunc &errorFunc) const
+	{
+		heap[1].nodeID = pChild;
+		heap[1].error = NodeError(frame, pChild, errorFunc);
+		color = color + heap[1].color;
+		HeapMoveDown(heap, 1, numLights);
+	}
+
+	// Adds the node sampled into heap[numLights + 1] to the cut
+	template <typename HeapDataType>
+	static void AddCutNode(HeapDataType *heap, int &numLights, CPUColor &color)
+	{
+		numLights++;
+		color = color + heap[numLights].color;
+		HeapMoveUp(heap, numLights);
+	}
+
+	template <int Width, typename HeapDataType, typename AttenFunc, typename ErrorFunc, typename RandFunc, typename Policy>
+	void EvalPacket(HeapDataType *heaps, int heapArraySize, const ShadingPacket<Width> &packet, float errorLimit,
+		AttenFunc &attenFunc, ErrorFunc &errorFunc, RandFunc &nrandom, int *numLights, Policy) const
+	{
+		// no bound tests while sampling, evaluate the lanes one by one
+		for (int lane = 0; lane < packet.count; lane++) {
+			glm::vec3 T, B;
+			CoordinateSystem(packet.N[lane], &T, &B);
+			numLights[lane] = Eval(heaps + lane * heapArraySize, heapArraySize, packet.p[lane], packet.N[lane], T, B, packet.wo[lane], errorLimit,
+				[&](int lightID, HeapDataType &hd) { return attenFunc(lane, lightID, hd); }, errorFunc, [&]() { return nrandom(lane); });
+		}
+	}
+
+	template <int Width, typename HeapDataType, typename AttenFunc, typename ErrorFunc, typename RandFunc>
+	void EvalPacket(HeapDataType *heaps, int heapArraySize, const ShadingPacket<Width> &packet, float errorLimit,
+		AttenFunc &attenFunc, ErrorFunc &errorFunc, RandFunc &nrandom, int *numLights, LightCutsHierarchical) const
+	{
+		PacketFrame<Width> frame(packet);
+		HeapDataType *heap[Width];
+		HeapDataType *newNodes[Width];
+		CPUColor color[Width];
+		int nodeIDs[Width];
+		int active = 0;
+		for (int lane = 0; lane < packet.count; lane++) {
+			heap[lane] = heaps + lane * heapArraySize;
+			newNodes[lane] = &heap[lane][1];
+			nodeIDs[lane] = 0;
+			active |= 1 << lane;
+		}
+
+		SampleNodePacket(frame, nodeIDs, active, newNodes, attenFunc, errorFunc, nrandom);
+		for (int lane = 0; lane < packet.count; lane++) {
+			numLights[lane] = 1;
+			color[lane] = heap[lane][1].color;
+		}
+
+		while (true) {
+			for (int lane = 0; lane < packet.count; lane++) {
+				if ((active & (1 << lane)) && !CanRefine(heap[lane], heapArraySize, numLights[lane], color[lane], errorLimit)) active &= ~(1 << lane);
+			}
+			if (CountLanes(active) * 2 < packet.count || active == 0) break;
+
+			// split the nodes with the largest errors, testing the bounds of all their children together
+			int pChild[Width] = {}, sChild[Width] = {};
+			for (int lane = 0; lane < packet.count; lane++) {
+				if ((active & (1 << lane)) == 0) continue;
+				HeapDataType &hd = heap[lane][1];
+				pChild[lane] = traversalNodes[hd.nodeID].primaryChild;
+				sChild[lane] = traversalNodes[hd.nodeID].secondaryChild;
+				assert(pChild[lane] >= 0);
+				color[lane] = color[lane] - hd.color;
+				if (InSecondarySubtree(hd.sampledNodeID, sChild[lane])) Swap(pChild[lane], sChild[lane]);
+			}
+			float prob0[Width];
+			int live = FirstChildWeightPacket(frame, pChild, sChild, prob0);
+			for (int lane = 0; lane < packet.count; lane++) {
+				if ((active & (1 << lane)) == 0) continue;
+				SetSplitProb(heap[lane][1], (live & (1 << lane)) ? prob0[lane] : 1);
+				SetCutNode(heap[lane], numLights[lane], color[lane], pChild[lane], frame.lanes[lane], errorFunc);
+				newNodes[lane] = &heap[lane][numLights[lane] + 1];
+			}
+			SampleNodePacket(frame, sChild, active, newNodes, attenFunc, errorFunc, nrandom);
+			for (int lane = 0; lane < packet.count; lane++) {
+				if (active & (1 << lane)) AddCutNode(heap[lane], numLights[lane], color[lane]);
+			}
+		}
+
+		// the packet has diverged, finish the lanes one by one
+		for (int lane = 0; lane < packet.count; lane++) {
+			auto laneAttenFunc = [&](int lightID, HeapDataType &hd) { return attenFunc(lane, lightID, hd); };
+			auto laneRandom = [&]() { return nrandom(lane); };
+			while (CanRefine(heap[lane], heapArraySize, numLights[lane], color[lane], errorLimit)) {
+				RefineCut(heap[lane], numLights[lane], color[lane], frame.lanes[lane], laneAttenFunc, errorFunc, laneRandom);
+			}
+			heap[lane][0].nodeID = numLights[lane];
+			heap[lane][0].color = color[lane];
+		}
+	}
+
+	static int CountLanes(int mask)
+	{
+		int count = 0;
+		for (; mask; mask &= mask - 1) count++;
+		return count;
+	}
+
+	// Shading points and their frames, one per lane
+	template <int Width>
+	struct SimdFrame
+	{
+		SimdFloat<Width> p[3], N[3], T[3], B[3];
+
+		SimdFrame() {}
+		// the same shading point in all lanes
+		SimdFrame(const glm::vec3 &p, const glm::vec3 &N, const glm::vec3 &T, const glm::vec3 &B)
+		{
+			for (int i = 0; i < 3; i++) {
+				this->p[i] = SimdFloat<Width>(p[i]);
+				this->N[i] = SimdFloat<Width>(N[i]);
+				this->T[i] = SimdFloat<Width>(T[i]);
+				this->B[i] = SimdFloat<Width>(B[i]);
+			}
+		}
+	};
+
+	// The shading points of a packet, one lane per point
+	template <int Width>
+	struct PacketFrame : public SimdFrame<Width>
+	{
+		ShadingFrame lanes[Width];
+
+		PacketFrame(const ShadingPacket<Width> &packet)
+		{
+			SimdFloat<Width> *p = this->p, *N = this->N, *T = this->T, *B = this->B;
+			float v[4][3][Width] = {};
+			for (int lane = 0; lane < packet.count; lane++) {
+				glm::vec3 t, b;
+				CoordinateSystem(packet.N[lane], &t, &b);
+				lanes[lane] = ShadingFrame(packet.p[lane], packet.N[lane], t, b);
+				for (int i = 0; i < 3; i++) {
+					v[0][i][lane] = packet.p[lane][i];
+					v[1][i][lane] = packet.N[lane][i];
+					v[2][i][lane] = t[i];
+					v[3][i][lane] = b[i];
 				}
-				colorIntens = GetColorIntensity(color);
+			}
+			for (int i = 0; i < 3; i++) {
+				p[i] = SimdFloat<Width>::Load(v[0][i]);
+				N[i] = SimdFloat<Width>::Load(v[1][i]);
+				T[i] = SimdFloat<Width>::Load(v[2][i]);
+				B[i] = SimdFloat<Width>::Load(v[3][i]);
 			}
 		}
+	};
 
-		heap[0].nodeID = numLights;
-		heap[0].color = color;
+	// The bounding boxes of one node per lane
+	template <int Width>
+	struct PacketBox
+	{
+		SimdFloat<Width> lo[3], hi[3];
+	};
 
-#if defined(LIGHTCUTS_STOCHASTIC) && !defined(LIGHTCUTS_HIERARCHICAL)
-		heap[0].one_over_prob = nodes[0].probTree;
-		for (int i = 1; i <= numLights; i++) {
-			heap[i].one_over_prob = nodes[heap[i].nodeID].probTree / nodes[heap[i].sampledNodeID].probTree;
+	template <int Width>
+	void GatherBoxes(const int *nodeIDs, PacketBox<Width> &box, SimdFloat<Width> &intensity) const
+	{
+		float v[7][Width];
+		for (int lane = 0; lane < Width; lane++) {
+			TraversalNode const &node = traversalNodes[nodeIDs[lane]];
+			for (int i = 0; i < 3; i++) {
+				v[i][lane] = node.boundBox.pos[i];
+				v[i + 3][lane] = node.boundBox.end[i];
+			}
+			v[6][lane] = node.probTree;
+		}
+		for (int i = 0; i < 3; i++) {
+			box.lo[i] = SimdFloat<Width>::Load(v[i]);
+			box.hi[i] = SimdFloat<Width>::Load(v[i + 3]);
+		}
+		intensity = SimdFloat<Width>::Load(v[6]);
+	}
+
+	// The extent of the box along the given direction per lane. The 8 corners are not needed, as the coordinates are independent.
+	template <int Width>
+	static void DistRangeAlong(const SimdFrame<Width> &frame, const SimdFloat<Width> *dir, const PacketBox<Width> &box, SimdFloat<Width> &dmin, SimdFloat<Width> &dmax)
+	{
+		dmin = SimdFloat<Width>(0);
+		dmax = SimdFloat<Width>(0);
+		for (int i = 0; i < 3; i++) {
+			SimdFloat<Width> d0 = dir[i] * (box.lo[i] - frame.p[i]);
+			SimdFloat<Width> d1 = dir[i] * (box.hi[i] - frame.p[i]);
+			dmin = dmin + Min(d0, d1);
+			dmax = dmax + Max(d0, d1);
+		}
+	}
+
+	// GeomTermBound of all lanes
+	template <int Width>
+	static SimdFloat<Width> GeomTermBoundPacket(const SimdFrame<Width> &frame, const PacketBox<Width> &box)
+	{
+		SimdFloat<Width> zero(0), nrmMin, nrmMax, yMin, yMax, zMin, zMax;
+		DistRangeAlong(frame, frame.N, box, nrmMin, nrmMax);
+		DistRangeAlong(frame, frame.T, box, yMin, yMax);
+		DistRangeAlong(frame, frame.B, box, zMin, zMax);
+		SimdFloat<Width> y_amin = Select((yMin < zero) & (yMax > zero), zero, Min(Abs(yMin), Abs(yMax)));
+		SimdFloat<Width> z_amin = Select((zMin < zero) & (zMax > zero), zero, Min(Abs(zMin), Abs(zMax)));
+		SimdFloat<Width> hyp = Sqrt(y_amin * y_amin + z_amin * z_amin + nrmMax * nrmMax);
+		return Select(nrmMax > zero, nrmMax / hyp, zero);
+	}
+
+	template <int Width>
+	static SimdFloat<Width> SquaredDistanceToClosestPointPacket(const SimdFrame<Width> &frame, const PacketBox<Width> &box)
+	{
+		SimdFloat<Width> zero(0), dist2(0);
+		for (int i = 0; i < 3; i++) {
+			SimdFloat<Width> d = Max(Max(box.lo[i] - frame.p[i], frame.p[i] - box.hi[i]), zero);
+			dist2 = dist2 + d * d;
+		}
+		return dist2;
+	}
+
+	template <int Width>
+	static SimdFloat<Width> WidthSquaredPacket(const PacketBox<Width> &box)
+	{
+		SimdFloat<Width> w2(0);
+		for (int i = 0; i < 3; i++) {
+			SimdFloat<Width> d = box.hi[i] - box.lo[i];
+			w2 = w2 + d * d;
 		}
+		return w2;
+	}
+
+	// FirstChildWeight of all lanes. Returns the lanes where a child contributes.
+	template <int Width>
+	int FirstChildWeightPacket(const SimdFrame<Width> &frame, const int *child0, const int *child1, float *prob0) const
+	{
+		PacketBox<Width> box0, box1;
+		SimdFloat<Width> intens0, intens1;
+		GatherBoxes(child0, box0, intens0);
+		GatherBoxes(child1, box1, intens1);
+
+		SimdFloat<Width> zero(0);
+		SimdFloat<Width> geom0 = GeomTermBoundPacket(frame, box0);
+		SimdFloat<Width> geom1 = GeomTermBoundPacket(frame, box1);
+		int dead = (geom0 + geom1 == zero).MoveMask();
+
+		SimdFloat<Width> intensGeom0 = intens0 * geom0;
+		SimdFloat<Width> intensGeom1 = intens1 * geom1;
+		SimdFloat<Width> l2_min0 = SquaredDistanceToClosestPointPacket(frame, box0);
+		SimdFloat<Width> l2_min1 = SquaredDistanceToClosestPointPacket(frame, box1);
+		SimdFloat<Width> inside = (l2_min0 < WidthSquaredPacket(box0)) | (l2_min1 < WidthSquaredPacket(box1));
+		SimdFloat<Width> ww0 = l2_min1 * intensGeom0;
+		SimdFloat<Width> ww1 = l2_min0 * intensGeom1;
+		Select(inside, intensGeom0 / (intensGeom0 + intensGeom1), ww0 / (ww0 + ww1)).Store(prob0);
+		return ~dead & ((1 << Width) - 1);
+	}
+
+	// SampleNode of the given lanes, writing the samples of nodeIDs[lane] into *hds[lane]
+	template <int Width, typename HeapDataType, typename AttenFunc, typename ErrorFunc, typename RandFunc>
+	void SampleNodePacket(const PacketFrame<Width> &frame, const int *nodeIDs, int lanes, HeapDataType **hds,
+		AttenFunc &attenFunc, ErrorFunc &errorFunc, RandFunc &nrandom) const
+	{
+		int id[Width] = {};
+		float r[Width];
+		double nprob[Width];
+		bool deadBranch[Width];
+		int descending = 0;
+		for (int lane = 0; lane < Width; lane++) {
+			if ((lanes & (1 << lane)) == 0) continue;
+			id[lane] = nodeIDs[lane];
+			nprob[lane] = 1;
+			deadBranch[lane] = false;
+			if (traversalNodes[id[lane]].primaryChild >= 0) {
+				r[lane] = nrandom(lane);
+				descending |= 1 << lane;
+			}
+		}
+
+		while (descending) {
+			int c0[Width] = {}, c1[Width] = {};
+			for (int lane = 0; lane < Width; lane++) {
+				if ((descending & (1 << lane)) == 0) continue;
+				c0[lane] = traversalNodes[id[lane]].primaryChild;
+				c1[lane] = traversalNodes[id[lane]].secondaryChild;
+			}
+			float prob0[Width];
+			int live = FirstChildWeightPacket(frame, c0, c1, prob0);
+			for (int lane = 0; lane < Width; lane++) {
+				if ((descending & (1 << lane)) == 0) continue;
+				if ((live & (1 << lane)) == 0) deadBranch[lane] = true;
+				else DescendStep(id[lane], r[lane], nprob[lane], c0[lane], c1[lane], prob0[lane]);
+				if (deadBranch[lane] || traversalNodes[id[lane]].secondaryChild < 0) descending &= ~(1 << lane);
+			}
+		}
+
+		for (int lane = 0; lane < Width; lane++) {
+			if ((lanes & (1 << lane)) == 0) continue;
+			auto laneAttenFunc = [&](int lightID, HeapDataType &hd) { return attenFunc(lane, lightID, hd); };
+			SetHierarchicalSample(*hds[lane], nodeIDs[lane], id[lane], nprob[lane], deadBranch[lane], laneAttenFunc);
+			hds[lane]->error = NodeError(frame.lanes[lane], nodeIDs[lane], errorFunc);
+		}
+	}
+
+	void EncodeCompactNode(CompactNode &node, int id, const aabb &parentBound, float parentIntensity) const
+	{
+		TraversalNode const &tn = traversalNodes[id];
+		uint32_t q[6];
+		glm::vec3 extent = (parentBound.end - parentBound.pos) * (1.0f / 255);
+		for (int i = 0; i < 3; i++) {
+			q[i] = EncodeCompactCoord(tn.boundBox.pos[i], parentBound.pos[i], extent[i], false);
+			q[i + 3] = EncodeCompactCoord(tn.boundBox.end[i], parentBound.pos[i], extent[i], true);
+		}
+		float fraction = parentIntensity > 0 ? SumVal(nodeColors[id]) / parentIntensity : 0.f;
+		uint32_t half = FloatToHalf(fraction);
+		if (half == 0 && fraction > 0) half = 1;	// keep the light reachable
+		node.boundLo = q[0] | (q[1] << 8) | (q[2] << 16) | (q[3] << 24);
+		node.boundHiIntensity = q[4] | (q[5] << 8) | (half << 16);
+		node.ID = tn.primaryChild >= 0 ? tn.primaryChild : -1 - tn.lightID;
+#ifdef LIGHT_CONE
+		node.cone = UseCones ? EncodeCompactCone(nodeCones[id]) : 0xFF000000;	// no cone: all directions
 #endif
-		return numLights;
 	}
 
-	Node const & GetNode(int id) const { return nodes[id]; }
+	// Quantizes a coordinate of a child box, rounding down for the min corner and up for the max corner
+	static uint32_t EncodeCompactCoord(float v, float parentMin, float extent, bool roundUp)
+	{
+		if (extent <= 0) return 0;
+		float t = (v - parentMin) / extent;
+		int q = std::max(0, std::min(255, int(roundUp ? ceilf(t) : floorf(t))));
+		if (roundUp) while (q < 255 && DecodeCompactCoord(q, parentMin, extent) < v) q++;
+		else while (q > 0 && DecodeCompactCoord(q, parentMin, extent) > v) q--;
+		return uint32_t(q);
+	}
 
-	int GetNumOfNodes() {
-		return nodes.size();
+	// Octahedral encoding of the axis, with the angle widened by the error of the encoded axis
+	static uint32_t EncodeCompactCone(const glm::vec4 &cone)
+	{
+		glm::vec3 axis(cone);
+		float len = std::abs(axis.x) + std::abs(axis.y) + std::abs(axis.z);
+		if (len <= 0) return 0xFF000000;
+		axis /= len;
+		glm::vec2 e(axis.x, axis.y);
+		if (axis.z < 0) {
+			e.x = (1 - std::abs(axis.y)) * (axis.x >= 0 ? 1.f : -1.f);
+			e.y = (1 - std::abs(axis.x)) * (axis.y >= 0 ? 1.f : -1.f);
+		}
+		uint32_t qx = uint32_t(std::max(0.f, std::min(4095.f, (e.x * 0.5f + 0.5f) * 4095 + 0.5f)));
+		uint32_t qy = uint32_t(std::max(0.f, std::min(4095.f, (e.y * 0.5f + 0.5f) * 4095 + 0.5f)));
+		uint32_t encoded = qx | (qy << 12);
+		glm::vec3 decodedAxis(DecodeCompactCone(encoded));
+		float axisError = acosf(std::max(-1.f, std::min(1.f, glm::dot(decodedAxis, glm::normalize(glm::vec3(cone))))));
+		uint32_t qa = uint32_t(std::min(255.f, ceilf((cone.w + axisError) * (255 / PI))));
+		return encoded | (qa << 24);
 	}
 
-private:
-	std::vector<Node> nodes;
+	template <typename LightConeFunc>
+	void SetLightCone(int nodeID, int lightID, LightConeFunc &lightConeFunc, std::true_type) { nodeCones[nodeID] = lightConeFunc(lightID); }
+	template <typename LightConeFunc>
+	void SetLightCone(int, int, LightConeFunc &, std::false_type) {}
 
-	static float MaxVal(const CPUColor  &c) { return c.r > c.g ? (c.r > c.b ? c.r : c.b) : (c.g > c.b ? c.g : c.b); }
-	static float SumVal(const CPUColor  &c) { return c.r + c.g + c.b; }
+	static void SetLeafProb(TraversalNode &leaf, float intensity, std::true_type) { leaf.probTree = intensity; }
+	static void SetLeafProb(TraversalNode &, float, std::false_type) {}
 
-	template <typename T> static void Swap(T &a, T &b) { T t = a; a = b; b = t; }
+	static void MergeProb(TraversalNode &node, TraversalNode const &node0, TraversalNode const &node1, std::true_type)
+	{
+		node.probTree = node0.probTree + node1.probTree;
+	}
+	static void MergeProb(TraversalNode &, TraversalNode const &, TraversalNode const &, std::false_type) {}
+
+	// Orders the nodes depth first, keeping the two children of a node next to each other.
+	// The descendants of a node are consecutive and start at its primary child, and those of the primary child come first.
+	// The subtree sizes give the new index of every node without a search: if the descendants of a node start at d,
+	// its children go to d and d + 1, and the descendants of the secondary child start after the ones of the primary child.
+	// The top of the tree is placed serially and the subtrees of at most LIGHTCUTS_REORDER_TASK_NODES nodes in parallel.
+	// Only the nodes under rootID are kept.
+	void ReorderNodes(int rootID, std::true_type)
+	{
+		if (rootID < 0) return;
+		BuildWorkspace &workspace = Workspace();
+		int numNodes = workspace.subtreeSizes[rootID];
+		workspace.orderedNodes.resize(numNodes);
+		workspace.orderedColors.resize(numNodes);
+		if (UseCones) workspace.orderedCones.resize(numNodes);
+
+		std::vector<PlacedNode> &stack = workspace.reorderStack;
+		std::vector<PlacedNode> &tasks = workspace.reorderTasks;
+		stack.clear();
+		tasks.clear();
+		stack.push_back({ rootID, 0, 1 });
+		while (!stack.empty()) {
+			PlacedNode placed = stack.back();
+			stack.pop_back();
+			if (workspace.subtreeSizes[placed.nodeID] <= LIGHTCUTS_REORDER_TASK_NODES) tasks.push_back(placed);
+			else PlaceNode(placed, [&](const PlacedNode &child) { stack.push_back(child); });
+		}
 
-	aabb NodeBound(Node &node0, Node &node1)
+		concurrency::parallel_for(0, (int)tasks.size(), [&](int t)
+		{
+			PlacedNode taskStack[LIGHTCUTS_REORDER_TASK_NODES / 2 + 1];	// at most one entry per leaf
+			int stackPos = 0;
+			taskStack[stackPos++] = tasks[t];
+			while (stackPos > 0) {
+				PlacedNode placed = taskStack[--stackPos];
+				PlaceNode(placed, [&](const PlacedNode &child) { taskStack[stackPos++] = child; });
+			}
+		});
+
+		traversalNodes.swap(workspace.orderedNodes);
+		nodeColors.swap(workspace.orderedColors);
+		if (UseCones) nodeCones.swap(workspace.orderedCones);
+	}
+
+	// Copies a node to its new index in the ordered arrays and passes its children to push
+	template <typename PushFunc>
+	void PlaceNode(const PlacedNode &placed, PushFunc push)
 	{
-		glm::vec3 boundMin = node0.boundBox.pos;
-		if (boundMin.x > node1.boundBox.pos.x) boundMin.x = node1.boundBox.pos.x;
-		if (boundMin.y > node1.boundBox.pos.y) boundMin.y = node1.boundBox.pos.y;
-		if (boundMin.z > node1.boundBox.pos.z) boundMin.z = node1.boundBox.pos.z;
-		glm::vec3 boundMax = node0.boundBox.end;
-		if (boundMax.x < node1.boundBox.end.x) boundMax.x = node1.boundBox.end.x;
-		if (boundMax.y < node1.boundBox.end.y) boundMax.y = node1.boundBox.end.y;
-		if (boundMax.z < node1.boundBox.end.z) boundMax.z = node1.boundBox.end.z;
-		return aabb(boundMin, boundMax);
+		BuildWorkspace &workspace = Workspace();
+		TraversalNode node = traversalNodes[placed.nodeID];
+		if (node.primaryChild >= 0) {	// internal node
+			int d = placed.firstDescendant;
+			int primarySize = workspace.subtreeSizes[node.primaryChild];
+			push({ node.secondaryChild, d + 1, d + 1 + primarySize });
+			push({ node.primaryChild, d, d + 2 });
+			node.primaryChild = d;
+			node.secondaryChild = d + 1;
+		}
+		workspace.orderedNodes[placed.newID] = node;
+		workspace.orderedColors[placed.newID] = nodeColors[placed.nodeID];
+		if (UseCones) workspace.orderedCones[placed.newID] = nodeCones[placed.nodeID];
 	}
+	void ReorderNodes(int, std::false_type) {}
 
-	static float GetColorIntensity(const CPUColor &color)
+	// Returns true if the sampled node is sChild or one of its descendants, given that it is in the subtree of their parent
+	bool InSecondarySubtree(int sampledNodeID, int sChild) const
 	{
-		float intens = SumVal(color) / 3.0f;
-		if (intens < LIGHTCUTS_MIN_INTENSITY) intens = LIGHTCUTS_MIN_INTENSITY;
-		return intens;
+		int firstDescendant = traversalNodes[sChild].primaryChild;
+		return sampledNodeID == sChild || (firstDescendant >= 0 && sampledNodeID >= firstDescendant);
+	}
+
+	// Returns the total intensity of the lights that come before the subtree of the node, taking the primary children first.
+	// The descendants of a node are consecutive, so the path to the node is found from the indices on the way down.
+	float ProbStart(int id) const
+	{
+		float probStart = 0;
+		int nodeID = 0;
+		while (nodeID != id) {
+			TraversalNode const &node = traversalNodes[nodeID];
+			if (InSecondarySubtree(id, node.secondaryChild)) {
+				probStart += traversalNodes[node.primaryChild].probTree;
+				nodeID = node.secondaryChild;
+			}
+			else nodeID = node.primaryChild;
+		}
+		return probStart;
+	}
+
+	void SetNodeSampleData(Node &node, int id, std::true_type) const
+	{
+		TraversalNode const &tn = traversalNodes[id];
+		node.probStart = ProbStart(id);
+		node.probTree = tn.probTree;
+
+		// The GPU tree uses 1-based child indices and the leaves point at 2 * numLights + lightID
+		if (tn.primaryChild >= 0) {
+			node.primaryChild = tn.primaryChild + 1;
+			node.secondaryChild = tn.secondaryChild + 1;
+		}
+		else {
+			node.primaryChild = GetNumOfNodes() + 1 + tn.lightID;
+			node.secondaryChild = -1;
+		}
+	}
+	void SetNodeSampleData(Node &node, int id, std::false_type) const
+	{
+		TraversalNode const &tn = traversalNodes[id];
+		node.primaryChild = tn.primaryChild;
+		node.secondaryChild = tn.secondaryChild;
+		int slot = id * SamplingPolicy::repCount;
+		node.nodeLights.assign(repLights.begin() + slot, repLights.begin() + slot + repLightCounts[id]);
+		node.nodeLightCDF.assign(repLightCDFs.begin() + slot, repLightCDFs.begin() + slot + repLightCounts[id]);
+	}
+
+	// Picks the light that represents node nodeID and evaluates it
+	template <typename HeapDataType, typename AttenFunc, typename RandFunc>
+	void SampleNode(HeapDataType &hd, int nodeID, const ShadingFrame &, AttenFunc &attenFunc, RandFunc &nrandom, LightCutsStochastic) const
+	{
+		int id = nodeID;
+		if (traversalNodes[nodeID].primaryChild >= 0) {
+			// r is relative to the start of the current subtree, so only the intensities on the path are read
+			float r = nrandom() * traversalNodes[nodeID].probTree;
+			while (traversalNodes[id].secondaryChild >= 0) {
+				int c0 = traversalNodes[id].primaryChild;
+				float p0 = traversalNodes[c0].probTree;
+				if (r < p0) id = c0;
+				else {
+					r -= p0;
+					id = traversalNodes[id].secondaryChild;
+				}
+			}
+		}
+		hd.sampledNodeID = id;
+		hd.nodeID = nodeID;
+		hd.atten = attenFunc(traversalNodes[id].lightID, hd);
+		CPUColor nodeColor = lightType == LightType::POINT ? nodeColors[nodeID] : 1.f;
+		hd.color = nodeColor * hd.atten;
+	}
+	template <typename HeapDataType, typename AttenFunc, typename RandFunc>
+	void SampleNode(HeapDataType &hd, int nodeID, const ShadingFrame &frame, AttenFunc &attenFunc, RandFunc &nrandom, LightCutsHierarchical) const
+	{
+		int id = nodeID;
+		double nprob = 1;	// probability of picking that node
+		bool deadBranch = false;
+		if (traversalNodes[nodeID].primaryChild >= 0) {
+			float r = nrandom();
+			while (traversalNodes[id].secondaryChild >= 0) {
+				int c0 = traversalNodes[id].primaryChild;
+				int c1 = traversalNodes[id].secondaryChild;
+				float prob0;
+				if (!FirstChildWeight(frame, prob0, c0, c1)) {
+					deadBranch = true;
+					break;
+				}
+				DescendStep(id, r, nprob, c0, c1, prob0);
+			}
+		}
+		SetHierarchicalSample(hd, nodeID, id, nprob, deadBranch, attenFunc);
+	}
+
+	// Picks one of the children during the hierarchical descent, reusing the random number
+	static void DescendStep(int &id, float &r, double &nprob, int c0, int c1, float prob0)
+	{
+		if (r < prob0) {
+			id = c0;
+			r /= prob0;
+			nprob *= prob0;
+		}
+		else {
+			id = c1;
+			r = (r - prob0) / (1 - prob0);
+			nprob *= (1 - prob0);
+		}
+	}
+
+	// Stores the sample of node nodeID that the hierarchical descent has reached at node id
+	template <typename HeapDataType, typename AttenFunc>
+	void SetHierarchicalSample(HeapDataType &hd, int nodeID, int id, double nprob, bool deadBranch, AttenFunc &attenFunc) const
+	{
+		hd.one_over_prob = nprob == 0.f ? 0.f : 1.0f / nprob;
+		hd.sampledNodeID = id;
+		hd.nodeID = nodeID;
+		hd.atten = deadBranch ? CPUColor(0, 0, 0) : attenFunc(traversalNodes[id].lightID, hd);
+		CPUColor nodeColor = lightType == LightType::POINT ? nodeColors[id] : 1.f;
+		hd.color = hd.one_over_prob * nodeColor * hd.atten;
+	}
+	template <typename HeapDataType, typename AttenFunc, typename RandFunc, int RepCount>
+	void SampleNode(HeapDataType &hd, int nodeID, const ShadingFrame &, AttenFunc &attenFunc, RandFunc &nrandom, LightCutsRepresentative<RepCount>) const
+	{
+		int lightID = traversalNodes[nodeID].lightID;
+		if (repLightCounts[nodeID] > 0) {
+			float r = nrandom();
+			const float *cdf = &repLightCDFs[nodeID * RepCount];
+			int i = int(std::lower_bound(cdf, cdf + repLightCounts[nodeID] - 1, r) - cdf);
+			lightID = repLights[nodeID * RepCount + i];
+		}
+		hd.sampledLightID = lightID;
+		hd.nodeID = nodeID;
+		hd.atten = attenFunc(lightID, hd);
+		CPUColor nodeColor = lightType == LightType::POINT ? nodeColors[nodeID] : 1.f;
+		hd.color = nodeColor * hd.atten;
 	}
 
-	template <typename RandFunc>
-	void InitNodeLights(RandFunc randFunc)
+	// Moves the sample of a refined node to the child that it came from (pChild) and updates its contribution
+	template <typename HeapDataType>
+	void SplitSample(HeapDataType &hd, int &pChild, int &sChild, const ShadingFrame &, LightCutsStochastic) const
+	{
+		if (InSecondarySubtree(hd.sampledNodeID, sChild)) Swap(pChild, sChild);
+		CPUColor nodeColor = lightType == LightType::POINT ? nodeColors[pChild] : 1.f;
+		hd.color = nodeColor * hd.atten;
+	}
+	template <typename HeapDataType>
+	void SplitSample(HeapDataType &hd, int &pChild, int &sChild, const ShadingFrame &frame, LightCutsHierarchical) const
+	{
+		if (InSecondarySubtree(hd.sampledNodeID, sChild)) Swap(pChild, sChild);
+		float prob0 = 1;	// both children can be dead when the sample is, it adds nothing then
+		FirstChildWeight(frame, prob0, pChild, sChild);
+		SetSplitProb(hd, prob0);
+	}
+	// The sample of a split node with hierarchical sampling, given the probability of descending to the child that it came from
+	template <typename HeapDataType>
+	void SetSplitProb(HeapDataType &hd, float prob0) const
+	{
+		hd.one_over_prob *= prob0;
+		CPUColor nodeColor = lightType == LightType::POINT ? nodeColors[hd.sampledNodeID] : 1.f;
+		hd.color = hd.one_over_prob * nodeColor * hd.atten;
+	}
+	template <typename HeapDataType, int RepCount>
+	void SplitSample(HeapDataType &hd, int &pChild, int &sChild, const ShadingFrame &, LightCutsRepresentative<RepCount>) const
 	{
-#ifdef LIGHTCUTS_REP_COUNT
-		InitNodeLights(0, randFunc);
-		// normalize CDFs
-		for (Node &node : nodes) {
-			if (node.nodeLightCDF.size() > 0) {
-				float total = node.nodeLightCDF.back();
-				for (float &cdf : node.nodeLightCDF) cdf /= total;
+		if (repLightCounts[sChild] > 0) {
+			const int *lights = &repLights[sChild * RepCount];
+			for (int i = 0; i < repLightCounts[sChild]; ++i) {
+				if (lights[i] == hd.sampledLightID) {
+					Swap(pChild, sChild);
+					break;
+				}
 			}
 		}
+		else {
+			if (traversalNodes[sChild].lightID == hd.sampledLightID) Swap(pChild, sChild);
+		}
+		CPUColor nodeColor = lightType == LightType::POINT ? nodeColors[pChild] : 1.f;
+		hd.color = nodeColor * hd.atten;
+	}
+
+	// Stores the probabilities of the samples of the final cut
+	template <typename HeapDataType>
+	void SetSampleProbs(HeapDataType *heap, int numLights, LightCutsStochastic) const
+	{
+		heap[0].one_over_prob = traversalNodes[0].probTree;
+		for (int i = 1; i <= numLights; i++) {
+			heap[i].one_over_prob = traversalNodes[heap[i].nodeID].probTree / traversalNodes[heap[i].sampledNodeID].probTree;
+		}
+	}
+	template <typename HeapDataType>
+	void SetSampleProbs(HeapDataType *, int, LightCutsHierarchical) const {}	// computed during the descent
+	template <typename HeapDataType, int RepCount>
+	void SetSampleProbs(HeapDataType *, int, LightCutsRepresentative<RepCount>) const {}
+
+	// The geometric term bound, the squared distance to the closest point and the squared width of a node.
+	// The leaves of point lights are single points, so they skip the box math.
+	void NodeBoundTerms(const ShadingFrame &frame, int nodeID, float &geom, float &l2_min, float &width2) const
+	{
+		TraversalNode const &node = traversalNodes[nodeID];
+		if (node.primaryChild < 0 && lightType == LightType::POINT) {
+			glm::vec3 d = node.boundBox.pos - frame.p;
+			float nrm = glm::dot(d, frame.N);
+			l2_min = glm::dot(d, d);
+			width2 = 0;
+			geom = nrm > 0 ? nrm / sqrtf(l2_min) : 0.f;
+			return;
+		}
+		geom = GeomTermBound(frame, node.boundBox);
+		l2_min = SquaredDistanceToClosestPoint(frame.p, node.boundBox);
+		width2 = node.boundBox.WidthSquared();
+	}
+
+	// The probability of descending to child0 in the hierarchical sampling. Returns false if neither child contributes.
+	bool FirstChildWeight(const ShadingFrame &frame, float &prob0, int child0, int child1) const
+	{
+		// Compute the weights
+		float geom0, geom1, l2_min0, l2_min1, width2_0, width2_1;
+		NodeBoundTerms(frame, child0, geom0, l2_min0, width2_0);
+		NodeBoundTerms(frame, child1, geom1, l2_min1, width2_1);
+
+		if (geom0 + geom1 == 0) return false;
+		float intensGeom0 = traversalNodes[child0].probTree*geom0;
+		float intensGeom1 = traversalNodes[child1].probTree*geom1;
+
+		if (l2_min0 < width2_0 || l2_min1 < width2_1)
+		{
+			prob0 = intensGeom0 / (intensGeom0 + intensGeom1);
+		}
+		else
+		{
+			float ww0 = l2_min1 * intensGeom0;
+			float ww1 = l2_min0 * intensGeom1;
+			prob0 = ww0 / (ww0 + ww1);	// closest point
+		}
+		return true;
+	}
+
+	void UpdateRepLightCDFs(std::true_type)
+	{
+		int numLights = (GetNumOfNodes() + 1) / 2;
+		concurrency::parallel_for(0, numLights - 1, [&](int nodeID)
+		{
+			int slot = nodeID * SamplingPolicy::repCount;
+			float *cdf = &repLightCDFs[slot];
+			int count = repLightCounts[nodeID];
+			for (int i = 0; i < count; ++i) {
+				cdf[i] = SumVal(nodeColors[repLights[slot + i] + numLights - 1]);
+				if (i > 0) cdf[i] += cdf[i - 1];
+			}
+			float total = cdf[count - 1];
+			for (int i = 0; i < count; ++i) cdf[i] /= total;
+		});
 	}
-	template <typename RandFunc>
-	void InitNodeLights(int nodeID, RandFunc randFunc)
+	void UpdateRepLightCDFs(std::false_type) {}
+
+	void InitNodeLights(std::false_type) {}
+	void InitNodeLights(std::true_type)
 	{
-		Node &node = nodes[nodeID];
-		if (node.primaryChild >= 0) {
-			InitNodeLights(node.primaryChild, randFunc);
-			InitNodeLights(node.secondaryChild, randFunc);
-			Node const &child1 = nodes[node.primaryChild];
-			Node const &child2 = nodes[node.secondaryChild];
-			auto addChildLights = [](Node &node, Node const &child, float &probOffset) {
-				if (child.nodeLights.size() == 0) {
-					node.nodeLights.push_back(child.lightID);
-					node.nodeLightCDF.push_back(child.color.r + child.color.g + child.color.b + probOffset);
+		// Children always have larger indices than their parents, so going from the last internal node to the root
+		// visits the children first. The slots hold the light intensities until all nodes are done.
+		struct Candidate
+		{
+			int   lightID;
+			float intensity;
+			float key;
+		};
+		const int repCount = SamplingPolicy::repCount;
+		Candidate candidates[2 * repCount];
+		int numInternalNodes = GetNumOfNodes() / 2;
+		for (int nodeID = numInternalNodes - 1; nodeID >= 0; nodeID--) {
+			int numCandidates = 0;
+			auto addChildLights = [&](int childID) {
+				int count = repLightCounts[childID];
+				if (count == 0) {
+					candidates[numCandidates++] = { traversalNodes[childID].lightID, SumVal(nodeColors[childID]), 0.f };
 				}
 				else {
-					node.nodeLights.reserve(node.nodeLights.size() + child.nodeLights.size());
-					node.nodeLightCDF.reserve(node.nodeLightCDF.size() + child.nodeLights.size());
-					for (size_t i = 0; i < child.nodeLights.size(); ++i) {
-						node.nodeLights.push_back(child.nodeLights[i]);
-						node.nodeLightCDF.push_back(child.nodeLightCDF[i] + probOffset);
+					int slot = childID * repCount;
+					for (int i = 0; i < count; ++i) {
+						candidates[numCandidates++] = { repLights[slot + i], repLightCDFs[slot + i], 0.f };
 					}
 				}
-				probOffset = node.nodeLightCDF.back();
 			};
-			float prob = 0.0f;
-			addChildLights(node, child1, prob);
-			addChildLights(node, child2, prob);
-			if (node.nodeLights.size() > LIGHTCUTS_REP_COUNT) {
-				std::vector<int> lights;
-				std::vector<float> cdf;
-				for (int i = 0; i < LIGHTCUTS_REP_COUNT; ++i) {
-					// pick a random light
-					float r = randFunc() * node.nodeLightCDF.back();
-					size_t j = 0;
-					for (; j < node.nodeLights.size() - 1; ++j) {
-						if (r <= node.nodeLightCDF[j]) break;
-					}
-					// add the selected light
-					lights.push_back(node.nodeLights[j]);
-					float p = node.nodeLightCDF[j];
-					if (j > 0) p -= node.nodeLightCDF[j - 1];
-					// remove the selected light
-					for (size_t k = j; k < node.nodeLights.size() - 1; ++k) {
-						node.nodeLights[k] = node.nodeLights[k + 1];
-						node.nodeLightCDF[k] = node.nodeLightCDF[k + 1] - p;
-					}
-					node.nodeLights.pop_back();
-					node.nodeLightCDF.pop_back();
-					// add the cdf
-					if (cdf.size() > 0) p += cdf.back();
-					cdf.push_back(p);
+			addChildLights(traversalNodes[nodeID].primaryChild);
+			addChildLights(traversalNodes[nodeID].secondaryChild);
+
+			if (numCandidates > repCount) {
+				// Pick the lights randomly without replacement, proportional to their intensities:
+				// keeping the largest keys u^(1/intensity) is equivalent to picking the lights one by one (Efraimidis and Spirakis)
+				for (int i = 0; i < numCandidates; ++i) {
+					float u = BuildRandom(buildSeed, nodeID, i + 1);
+					candidates[i].key = candidates[i].intensity > 0 ? logf(u) / candidates[i].intensity : -LIGHTCUTS_BIGFLOAT;
 				}
-				node.nodeLights.swap(lights);
-				node.nodeLightCDF.swap(cdf);
+				std::nth_element(candidates, candidates + repCount - 1, candidates + numCandidates,
+					[](const Candidate &a, const Candidate &b) { return a.key > b.key; });
+				numCandidates = repCount;
+			}
+
+			int slot = nodeID * repCount;
+			for (int i = 0; i < numCandidates; ++i) {
+				repLights[slot + i] = candidates[i].lightID;
+				repLightCDFs[slot + i] = candidates[i].intensity;
 			}
+			repLightCounts[nodeID] = numCandidates;
 		}
-#endif
+
+		// turn the intensities into normalized CDFs
+		concurrency::parallel_for(0, numInternalNodes, [&](int nodeID)
+		{
+			float *cdf = &repLightCDFs[nodeID * repCount];
+			int count = repLightCounts[nodeID];
+			for (int i = 1; i < count; ++i) cdf[i] += cdf[i - 1];
+			float total = cdf[count - 1];
+			for (int i = 0; i < count; ++i) cdf[i] /= total;
+		});
 	}
 };
 
 //-------------------------------------------------------------------------------
+
+// The variant used by the light tree builders; the cones follow the GPU node layout
+#ifdef LIGHT_CONE
+typedef LightCutsT<LightCutsHierarchical, true> LightCuts;
+#else
+typedef LightCutsT<LightCutsHierarchical, false> LightCuts;
+#endif
+
+//-------------------------------------------------------------------------------
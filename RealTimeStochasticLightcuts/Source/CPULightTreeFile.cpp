@@ -0,0 +1,79 @@
+// Copyright (c) 2020, Daqi Lin <daqi@cs.utah.edu>
+// All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "pch.h"
+#include "CPULightTreeFile.h"
+#include <fstream>
+
+bool WriteLightTreeFile(const std::string &filename, const Node *nodes, int numNodes, float globalBoundDiag,
+	const Node *BLASNodes, int numBLASNodes, const BLASInstanceHeader *BLASHeaders, int numBLASHeaders, uint64_t contentHash)
+{
+	if (numBLASNodes > 0 && numBLASHeaders <= 0) return false;
+	std::ofstream f(filename, std::ios_base::binary);
+	if (!f) return false;
+
+	LightTreeFileHeader header = MakeLightTreeFileHeader(numNodes, numBLASNodes, numBLASHeaders, globalBoundDiag, contentHash);
+	f.write((const char*)&header, sizeof(header));
+	f.seekp(header.nodeOffset);
+	f.write((const char*)nodes, numNodes * sizeof(Node));
+	if (numBLASHeaders > 0) {
+		f.seekp(header.BLASNodeOffset);
+		f.write((const char*)BLASNodes, numBLASNodes * sizeof(Node));
+		f.seekp(header.BLASHeaderOffset);
+		f.write((const char*)BLASHeaders, numBLASHeaders * sizeof(BLASInstanceHeader));
+	}
+	f.close();
+	return !f.fail();
+}
+
+bool MappedLightTree::Open(const std::string &filename)
+{
+	Close();
+
+	file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) {
+		file = nullptr;
+		return false;
+	}
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+		Close();
+		return false;
+	}
+	mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mapping != nullptr) data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (data == nullptr || !Init(data, size_t(size.QuadPart))) {
+		Close();
+		return false;
+	}
+	return true;
+}
+
+void MappedLightTree::Close()
+{
+	Init(nullptr, 0);
+	if (data != nullptr) UnmapViewOfFile(data);
+	if (mapping != nullptr) CloseHandle(mapping);
+	if (file != nullptr) CloseHandle(file);
+	data = nullptr;
+	mapping = nullptr;
+	file = nullptr;
+}
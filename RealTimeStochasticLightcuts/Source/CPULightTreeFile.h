@@ -0,0 +1,202 @@
+// Copyright (c) 2020, Daqi Lin <daqi@cs.utah.edu>
+// All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+#include <string>
+#include <cstdint>
+#include "CPULightCuts.h"
+
+#define LIGHTCUTS_FILE_MAGIC 0x3154434C		// "LCT1"
+#define LIGHTCUTS_FILE_VERSION 2
+#define LIGHTCUTS_FILE_ALIGNMENT 64			// of the sections of a light tree file
+
+// The header at the start of a light tree file, followed by its sections:
+// - the nodes of the tree in the GPU Node layout of LightCuts::ExportGPUNodes, node 0 unused, or no nodes for a file
+//   of BLASes only, as in the BLAS cache of MeshLightTreeBuilder. For a one-level tree
+//   the IDs from numNodes up are leaves at numNodes + light index. For a two-level tree this is the TLAS and its
+//   leaves are at numNodes + instance index.
+// - for a two-level tree, the nodes of all BLASes and one BLASInstanceHeader per instance, as in MeshLightTreeBuilder:
+//   the BLAS of an instance starts at nodeOffset with its root at nodeOffset + 1, and its leaves are at
+//   2 * numTreeLeafs + the first index of the triangle in the mesh light index buffer.
+// The node intensities are the probTree of the descent; probStart is not stored, as in LightCuts.
+// All the references are indices or offsets from the start of the file, so the file can be used from memory mapped
+// at any address, and the sections are aligned to LIGHTCUTS_FILE_ALIGNMENT bytes.
+struct LightTreeFileHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nodeSize;			// sizeof(Node), which depends on LIGHT_CONE
+	uint32_t headerSize;		// sizeof(BLASInstanceHeader)
+	int32_t  numNodes;			// including node 0
+	int32_t  numBLASNodes;
+	int32_t  numBLASHeaders;	// 0 for a one-level tree
+	float    globalBoundDiag;
+	uint64_t contentHash;		// of the inputs of the build, so that a cache can tell whether the tree is still valid; 0 if unused
+	uint64_t nodeOffset;
+	uint64_t BLASNodeOffset;
+	uint64_t BLASHeaderOffset;
+	uint64_t fileSize;
+};
+
+// Lays out a light tree file with the given section sizes
+inline LightTreeFileHeader MakeLightTreeFileHeader(int numNodes, int numBLASNodes, int numBLASHeaders, float globalBoundDiag, uint64_t contentHash = 0)
+{
+	auto align = [](uint64_t offset) { return (offset + LIGHTCUTS_FILE_ALIGNMENT - 1) / LIGHTCUTS_FILE_ALIGNMENT * LIGHTCUTS_FILE_ALIGNMENT; };
+	LightTreeFileHeader header = {};
+	header.magic = LIGHTCUTS_FILE_MAGIC;
+	header.version = LIGHTCUTS_FILE_VERSION;
+	header.nodeSize = sizeof(Node);
+	header.headerSize = sizeof(BLASInstanceHeader);
+	header.numNodes = numNodes;
+	header.numBLASNodes = numBLASNodes;
+	header.numBLASHeaders = numBLASHeaders;
+	header.globalBoundDiag = globalBoundDiag;
+	header.contentHash = contentHash;
+	header.nodeOffset = align(sizeof(LightTreeFileHeader));
+	header.BLASNodeOffset = align(header.nodeOffset + uint64_t(numNodes) * sizeof(Node));
+	header.BLASHeaderOffset = align(header.BLASNodeOffset + uint64_t(numBLASNodes) * sizeof(Node));
+	// the file ends with the last section that is not empty
+	header.fileSize = numBLASHeaders > 0 ? header.BLASHeaderOffset + uint64_t(numBLASHeaders) * sizeof(BLASInstanceHeader) :
+		(numBLASNodes > 0 ? header.BLASNodeOffset + uint64_t(numBLASNodes) * sizeof(Node) : header.nodeOffset + uint64_t(numNodes) * sizeof(Node));
+	return header;
+}
+
+// Writes a light tree file. Pass no BLASes for a one-level tree. Returns false if the file cannot be written,
+// or if BLAS nodes are passed without the BLAS headers that locate them.
+bool WriteLightTreeFile(const std::string &filename, const Node *nodes, int numNodes, float globalBoundDiag,
+	const Node *BLASNodes = nullptr, int numBLASNodes = 0, const BLASInstanceHeader *BLASHeaders = nullptr, int numBLASHeaders = 0, uint64_t contentHash = 0);
+
+// A light tree file in memory, used in place without copying or fixing up the nodes
+class LightTreeView
+{
+public:
+
+	// Checks the header and the section sizes against the size of the data, and the IDs of all the nodes in one pass:
+	// internal nodes must point at two children after them in their tree, and the leaves of the top tree at a light or
+	// instance of the file. Returns false if anything does not match, so that the descent cannot index out of the file.
+	bool Init(const void *data, size_t size)
+	{
+		header = nullptr;
+		if (size < sizeof(LightTreeFileHeader)) return false;
+		const LightTreeFileHeader *h = static_cast<const LightTreeFileHeader *>(data);
+		if (h->magic != LIGHTCUTS_FILE_MAGIC || h->version != LIGHTCUTS_FILE_VERSION) return false;
+		if (h->nodeSize != sizeof(Node) || h->headerSize != sizeof(BLASInstanceHeader)) return false;
+		if (h->numNodes < 0 || h->numNodes == 1 || h->numBLASNodes < 0 || h->numBLASHeaders < 0) return false;
+		LightTreeFileHeader expected = MakeLightTreeFileHeader(h->numNodes, h->numBLASNodes, h->numBLASHeaders, h->globalBoundDiag, h->contentHash);
+		if (memcmp(h, &expected, sizeof(expected)) != 0 || h->fileSize > size) return false;
+		if (h->numNodes > 0 && h->numBLASHeaders > 0 && h->numNodes != 2 * h->numBLASHeaders) return false;
+
+		const char *base = static_cast<const char *>(data);
+		const BLASInstanceHeader *instances = reinterpret_cast<const BLASInstanceHeader *>(base + h->BLASHeaderOffset);
+		std::vector<glm::ivec2> BLASes(h->numBLASHeaders);
+		for (int i = 0; i < h->numBLASHeaders; i++) {
+			if (instances[i].nodeOffset < 0 || instances[i].numTreeLeafs < 1 || instances[i].nodeOffset + 2 * int64_t(instances[i].numTreeLeafs) > h->numBLASNodes) return false;
+			BLASes[i] = glm::ivec2(instances[i].nodeOffset, instances[i].numTreeLeafs);
+		}
+
+		const Node *treeNodes = reinterpret_cast<const Node *>(base + h->nodeOffset);
+		const Node *treeBLASNodes = reinterpret_cast<const Node *>(base + h->BLASNodeOffset);
+		if (!CheckNodeIDs(treeNodes, h->numNodes, h->numNodes + h->numNodes / 2)) return false;
+		// the instances of a mesh share its BLAS, which is checked once; its leaves are triangles of the model, not of the file
+		std::sort(BLASes.begin(), BLASes.end(), [](const glm::ivec2 &a, const glm::ivec2 &b) { return a.x < b.x || (a.x == b.x && a.y < b.y); });
+		BLASes.erase(std::unique(BLASes.begin(), BLASes.end()), BLASes.end());
+		for (const glm::ivec2 &BLAS : BLASes) {
+			if (!CheckNodeIDs(treeBLASNodes + BLAS.x, 2 * BLAS.y, INT64_MAX)) return false;
+		}
+
+		header = h;
+		nodes = treeNodes;
+		BLASNodes = treeBLASNodes;
+		BLASHeaders = instances;
+		return true;
+	}
+
+	bool IsValid() const { return header != nullptr; }
+	const LightTreeFileHeader &GetHeader() const { return *header; }
+	const Node *GetNodes() const { return nodes; }
+	const Node *GetBLASNodes() const { return BLASNodes; }
+	const BLASInstanceHeader *GetBLASHeaders() const { return BLASHeaders; }
+
+	// Picks a light for the shading point with the hierarchical descent of LightCuts::SampleCompactLight, going on into
+	// the BLAS of the picked instance in a two-level tree. Returns the light index of a one-level tree, or the first index
+	// of the triangle of a two-level tree and sets its instance, and sets the probability of the light.
+	// Returns -1 if no light can contribute or the file has no top tree.
+	int SampleLight(const glm::vec3 &p, const glm::vec3 &N, float r, int &instanceID, float &prob) const
+	{
+		double nprob = 1;
+		instanceID = -1;
+		if (header->numNodes == 0) return -1;
+		int leaf = LightCuts::SampleNodeLight(nodes, 1, header->numNodes, LightCuts::ShadingFrame(p, N), r, nprob);
+		if (leaf < 0) return -1;
+		int index = leaf - header->numNodes;
+		if (header->numBLASHeaders > 0) {
+			// the BLAS bounds are in the space of the mesh, before the instance transform
+			const BLASInstanceHeader &instance = BLASHeaders[index];
+			glm::mat3 rotT = glm::transpose(instance.rotation);
+			glm::vec3 pBLAS = rotT * (p - instance.translation) / instance.scaling;
+			int leafStart = 2 * instance.numTreeLeafs;
+			leaf = LightCuts::SampleNodeLight(BLASNodes + instance.nodeOffset, 1, leafStart, LightCuts::ShadingFrame(pBLAS, rotT * N), r, nprob);
+			if (leaf < 0) return -1;
+			instanceID = index;
+			index = leaf - leafStart;
+		}
+		prob = float(nprob);
+		return index;
+	}
+
+private:
+
+	// the nodes of a tree in the GPU Node layout, with its leaves at numNodes up to leafEnd
+	static bool CheckNodeIDs(const Node *treeNodes, int numNodes, int64_t leafEnd)
+	{
+		for (int i = 1; i < numNodes; i++) {
+			int ID = treeNodes[i].ID;
+			if (ID >= numNodes ? ID >= leafEnd : (ID <= i || ID + 1 >= numNodes)) return false;
+		}
+		return true;
+	}
+
+	const LightTreeFileHeader *header = nullptr;
+	const Node *nodes = nullptr;
+	const Node *BLASNodes = nullptr;
+	const BLASInstanceHeader *BLASHeaders = nullptr;
+};
+
+// A light tree file mapped read-only into memory. The pages are shared with the other processes that map the same file.
+class MappedLightTree : public LightTreeView
+{
+public:
+
+	MappedLightTree() {}
+	~MappedLightTree() { Close(); }
+	MappedLightTree(const MappedLightTree &) = delete;
+	MappedLightTree &operator=(const MappedLightTree &) = delete;
+
+	// Returns false if the file cannot be mapped or is not a valid light tree file
+	bool Open(const std::string &filename);
+	void Close();
+
+private:
+
+	void *file = nullptr;
+	void *mapping = nullptr;
+	const void *data = nullptr;
+};
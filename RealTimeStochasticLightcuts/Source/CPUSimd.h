@@ -0,0 +1,144 @@
+// Copyright (c) 2020, Daqi Lin <daqi@cs.utah.edu>
+// All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+#include <immintrin.h>
+#include <type_traits>
+
+// Floats of several independent items (e.g. shading points) processed together.
+// Comparisons return masks with all bits set in the lanes where they hold.
+
+struct SimdFloat4
+{
+	static const int width = 4;
+	__m128 v;
+
+	SimdFloat4() {}
+	SimdFloat4(__m128 v) : v(v) {}
+	explicit SimdFloat4(float f) : v(_mm_set1_ps(f)) {}
+	SimdFloat4(float x, float y, float z, float w) : v(_mm_setr_ps(x, y, z, w)) {}
+
+	static SimdFloat4 Load(const float *p) { return _mm_loadu_ps(p); }
+	void Store(float *p) const { _mm_storeu_ps(p, v); }
+	int  MoveMask() const { return _mm_movemask_ps(v); }
+
+	friend SimdFloat4 operator+(SimdFloat4 a, SimdFloat4 b) { return _mm_add_ps(a.v, b.v); }
+	friend SimdFloat4 operator-(SimdFloat4 a, SimdFloat4 b) { return _mm_sub_ps(a.v, b.v); }
+	friend SimdFloat4 operator*(SimdFloat4 a, SimdFloat4 b) { return _mm_mul_ps(a.v, b.v); }
+	friend SimdFloat4 operator/(SimdFloat4 a, SimdFloat4 b) { return _mm_div_ps(a.v, b.v); }
+	friend SimdFloat4 operator<(SimdFloat4 a, SimdFloat4 b) { return _mm_cmplt_ps(a.v, b.v); }
+	friend SimdFloat4 operator>(SimdFloat4 a, SimdFloat4 b) { return _mm_cmpgt_ps(a.v, b.v); }
+	friend SimdFloat4 operator==(SimdFloat4 a, SimdFloat4 b) { return _mm_cmpeq_ps(a.v, b.v); }
+	friend SimdFloat4 operator&(SimdFloat4 a, SimdFloat4 b) { return _mm_and_ps(a.v, b.v); }
+	friend SimdFloat4 operator|(SimdFloat4 a, SimdFloat4 b) { return _mm_or_ps(a.v, b.v); }
+	friend SimdFloat4 Min(SimdFloat4 a, SimdFloat4 b) { return _mm_min_ps(a.v, b.v); }
+	friend SimdFloat4 Max(SimdFloat4 a, SimdFloat4 b) { return _mm_max_ps(a.v, b.v); }
+	friend SimdFloat4 Sqrt(SimdFloat4 a) { return _mm_sqrt_ps(a.v); }
+	friend SimdFloat4 Abs(SimdFloat4 a) { return _mm_andnot_ps(_mm_set1_ps(-0.f), a.v); }
+	// Picks a in the lanes where the mask is set and b elsewhere
+	friend SimdFloat4 Select(SimdFloat4 mask, SimdFloat4 a, SimdFloat4 b) { return _mm_blendv_ps(b.v, a.v, mask.v); }
+};
+
+#ifdef __AVX__
+struct SimdFloat8
+{
+	static const int width = 8;
+	__m256 v;
+
+	SimdFloat8() {}
+	SimdFloat8(__m256 v) : v(v) {}
+	explicit SimdFloat8(float f) : v(_mm256_set1_ps(f)) {}
+
+	static SimdFloat8 Load(const float *p) { return _mm256_loadu_ps(p); }
+	void Store(float *p) const { _mm256_storeu_ps(p, v); }
+	int  MoveMask() const { return _mm256_movemask_ps(v); }
+
+	friend SimdFloat8 operator+(SimdFloat8 a, SimdFloat8 b) { return _mm256_add_ps(a.v, b.v); }
+	friend SimdFloat8 operator-(SimdFloat8 a, SimdFloat8 b) { return _mm256_sub_ps(a.v, b.v); }
+	friend SimdFloat8 operator*(SimdFloat8 a, SimdFloat8 b) { return _mm256_mul_ps(a.v, b.v); }
+	friend SimdFloat8 operator/(SimdFloat8 a, SimdFloat8 b) { return _mm256_div_ps(a.v, b.v); }
+	friend SimdFloat8 operator<(SimdFloat8 a, SimdFloat8 b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+	friend SimdFloat8 operator>(SimdFloat8 a, SimdFloat8 b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ); }
+	friend SimdFloat8 operator==(SimdFloat8 a, SimdFloat8 b) { return _mm256_cmp_ps(a.v, b.v, _CMP_EQ_OQ); }
+	friend SimdFloat8 operator&(SimdFloat8 a, SimdFloat8 b) { return _mm256_and_ps(a.v, b.v); }
+	friend SimdFloat8 operator|(SimdFloat8 a, SimdFloat8 b) { return _mm256_or_ps(a.v, b.v); }
+	friend SimdFloat8 Min(SimdFloat8 a, SimdFloat8 b) { return _mm256_min_ps(a.v, b.v); }
+	friend SimdFloat8 Max(SimdFloat8 a, SimdFloat8 b) { return _mm256_max_ps(a.v, b.v); }
+	friend SimdFloat8 Sqrt(SimdFloat8 a) { return _mm256_sqrt_ps(a.v); }
+	friend SimdFloat8 Abs(SimdFloat8 a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.f), a.v); }
+	friend SimdFloat8 Select(SimdFloat8 mask, SimdFloat8 a, SimdFloat8 b) { return _mm256_blendv_ps(b.v, a.v, mask.v); }
+};
+#endif
+
+// A packet of Width lanes, made of 8-wide AVX blocks when AVX is enabled and Width is a multiple of 8, and of 4-wide SSE blocks otherwise
+template <int Width>
+struct SimdFloat
+{
+	static_assert(Width % 4 == 0, "The packet width must be a multiple of 4");
+#ifdef __AVX__
+	typedef typename std::conditional<Width % 8 == 0, SimdFloat8, SimdFloat4>::type Block;
+#else
+	typedef SimdFloat4 Block;
+#endif
+	static const int numBlocks = Width / Block::width;
+	Block b[numBlocks];
+
+	SimdFloat() {}
+	explicit SimdFloat(float f) { for (int i = 0; i < numBlocks; i++) b[i] = Block(f); }
+
+	static SimdFloat Load(const float *p)
+	{
+		SimdFloat r;
+		for (int i = 0; i < numBlocks; i++) r.b[i] = Block::Load(p + i * Block::width);
+		return r;
+	}
+	void Store(float *p) const { for (int i = 0; i < numBlocks; i++) b[i].Store(p + i * Block::width); }
+	// The bits of the lanes where the mask is set
+	int MoveMask() const
+	{
+		int m = 0;
+		for (int i = 0; i < numBlocks; i++) m |= b[i].MoveMask() << (i * Block::width);
+		return m;
+	}
+
+#define SIMDFLOAT_BINARY(op) \
+	friend SimdFloat op(const SimdFloat &x, const SimdFloat &y) { SimdFloat r; for (int i = 0; i < numBlocks; i++) r.b[i] = op(x.b[i], y.b[i]); return r; }
+	SIMDFLOAT_BINARY(operator+)
+	SIMDFLOAT_BINARY(operator-)
+	SIMDFLOAT_BINARY(operator*)
+	SIMDFLOAT_BINARY(operator/)
+	SIMDFLOAT_BINARY(operator<)
+	SIMDFLOAT_BINARY(operator>)
+	SIMDFLOAT_BINARY(operator==)
+	SIMDFLOAT_BINARY(operator&)
+	SIMDFLOAT_BINARY(operator|)
+	SIMDFLOAT_BINARY(Min)
+	SIMDFLOAT_BINARY(Max)
+#undef SIMDFLOAT_BINARY
+	friend SimdFloat Sqrt(const SimdFloat &x) { SimdFloat r; for (int i = 0; i < numBlocks; i++) r.b[i] = Sqrt(x.b[i]); return r; }
+	friend SimdFloat Abs(const SimdFloat &x) { SimdFloat r; for (int i = 0; i < numBlocks; i++) r.b[i] = Abs(x.b[i]); return r; }
+	friend SimdFloat Select(const SimdFloat &mask, const SimdFloat &x, const SimdFloat &y)
+	{
+		SimdFloat r;
+		for (int i = 0; i < numBlocks; i++) r.b[i] = Select(mask.b[i], x.b[i], y.b[i]);
+		return r;
+	}
+};
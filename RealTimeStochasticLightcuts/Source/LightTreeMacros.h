@@ -38,6 +38,20 @@ struct Node
 #endif
 };
 
+// 12 bytes (16 with LIGHT_CONE): a compressed Node, encoded by LightCuts::GetCompactTree.
+// The bounds are quantized to 8 bits per coordinate relative to the box of the parent, rounded outwards.
+// The intensity is the fraction of the intensity of the parent, as a half float.
+// Internal nodes point at their primary child, and the secondary child is at ID + 1. Leaves store -1 - light index.
+struct CompactNode
+{
+	uint boundLo;			// min x, y, z and max x, 8 bits each from the lowest
+	uint boundHiIntensity;	// max y, z, 8 bits each from the lowest, and the intensity fraction in the upper 16 bits
+	int ID;
+#ifdef LIGHT_CONE
+	uint cone;				// octahedral axis, 12 bits per coordinate, and the angle in the upper 8 bits, rounded up
+#endif
+};
+
 struct VizNode
 {
 	float3 boundMin;
@@ -28,9 +28,23 @@
 #include "ExportVizNodesCS.h"
 
 #include <ppl.h>
+#include "Hash.h"
 
 BoolVar m_EnableNodeViz("Visualization/Enable Node Viz", false);
 
+#ifdef CPU_BUILDER
+// build strategy of the light trees that are rebuilt every frame (VPLs, TLAS and one-level tree);
+// Adaptive picks the best tree that is expected to build within the budget
+const char* cpuBuildModeText[5] = { "Heap", "Locally Ordered", "Top-Down SAOH", "NN Chain", "Adaptive" };
+EnumVar m_CPUBuildMode("Light Tree/CPU Build Mode", LightTreeBuildSelector::numModes, 5, cpuBuildModeText);
+NumVar m_CPUBuildBudget("Light Tree/CPU Build Budget (ms)", 10.0f, 0.5f, 1000.0f, 0.5f);
+NumVar m_CPUBLASBuildBudget("Light Tree/CPU BLAS Build Budget (ms)", 200.0f, 1.0f, 10000.0f, 10.0f); // per BLAS, used by Adaptive in Init
+// keep the BLASes and the one-level tree of the loaded scene next to the model file, and load them on the next launch
+BoolVar m_CacheLightTrees("Light Tree/Cache Light Trees", true);
+// the cached one-level tree of a scene with more triangles is built out of core in Init, in buckets of at most this many triangles
+IntVar m_CPUMaxLightsInMemory("Light Tree/CPU Max Lights In Memory", 1 << 22, 1 << 10, (1 << 24) - 1, 1 << 18);
+#endif
+
 void MeshLightTreeBuilder::Init(ComputeContext& cptContext, Model1* model, int numModels /*= 1*/, bool oneLevelTree /*= false*/)
 {
 	this->oneLevelTree = oneLevelTree;
@@ -49,6 +63,9 @@ void MeshLightTreeBuilder::Init(ComputeContext& cptContext, Model1* model, int n
 	numMeshLights = meshLights.size();
 	numMeshLightInstances = model->m_CPUMeshLightInstancesBuffer.size();
 	CPUBLASInstanceHeaders.resize(numMeshLightInstances);
+#ifdef CPU_BUILDER
+	useLightTreeCache = m_CacheLightTrees && numMeshLights > 0;
+#endif
 
 	ListCounter[0].Create(L"GPU List Counter TLAS", 1, sizeof(uint32_t));
 	ListCounter[1].Create(L"GPU List Counter BLAS", 1, sizeof(uint32_t));
@@ -112,15 +129,59 @@ void MeshLightTreeBuilder::Init(ComputeContext& cptContext, Model1* model, int n
 
 		std::vector<Node> BLAS(numTotalBLASNodes);
 
+		cpuLightCuts.SetWorkspace(&buildWorkspace);
+		cpuTLASLightCuts.SetWorkspace(&buildWorkspace);
+
+		// the BLASes do not depend on the instances, so a cached file stays valid as long as the mesh lights and settings do not change
+		std::string BLASCacheFile = model->m_FileName + ".blas.lct";
+		uint64_t BLASCacheKey = useLightTreeCache ? LightTreeCacheKey(false) : 0;
+		bool BLASCacheHit = false;
+		if (useLightTreeCache)
+		{
+			MappedLightTree cache;
+			if (cache.Open(BLASCacheFile) && cache.GetHeader().contentHash == BLASCacheKey && cache.GetHeader().numNodes == 0 &&
+				cache.GetHeader().numBLASNodes == numTotalBLASNodes && cache.GetHeader().numBLASHeaders == numMeshLights)
+			{
+				BLASCacheHit = true;
+				for (int meshId = 0; meshId < numMeshLights; meshId++)
+				{
+					const BLASInstanceHeader& header = cache.GetBLASHeaders()[meshId];
+					if (header.nodeOffset != BLASOffsets[meshId] || header.numTreeLeafs != BLASTreeLeafs[meshId]) BLASCacheHit = false;
+				}
+				if (BLASCacheHit) memcpy(BLAS.data(), cache.GetBLASNodes(), numTotalBLASNodes * sizeof(Node));
+			}
+		}
+
+		const int topDownBLASMinTriangles = 1 << 16; // the chain builder is serial, split the largest emissive meshes top-down instead
+
 		for (int meshId = 0; meshId < numMeshLights; meshId++)
 		{
-			cpuLightCuts.SetLightType(LightCuts::LightType::REAL);
 			int meshIndexOffset = meshLights[meshId].indexOffset;
 			int numBLASTriangles = meshLights[meshId].numTriangles;
-			std::vector<glm::vec4> triangleCones(numBLASTriangles);
-			std::vector<glm::vec3> triangleCentroids(numBLASTriangles);
-			std::vector<CPUColor> trianglePowers(numBLASTriangles);
-			std::vector<aabb> triangleBounds(numBLASTriangles);
+			int BLASOffset = BLASOffsets[meshId];
+			int numNodes = 2 * numBLASTriangles;
+
+			if (BLASCacheHit)
+			{
+				// the bounds of the root are the union of the triangle bounds, as BLASbound below
+				m_BLASBounds[meshId] = aabb(BLAS[BLASOffset + 1].boundMin, BLAS[BLASOffset + 1].boundMax);
+#ifdef LIGHT_CONE
+				m_BLASCones[meshId] = BLAS[BLASOffset + 1].cone;
+#endif
+				m_BLASIntensities[meshId] = BLAS[BLASOffset + 1].intensity;
+				GenerateLevelIds(BLAS, CPUNodeBLASLevelBuffer, 1, BLASOffset, numNodes, 0);
+				continue;
+			}
+
+			cpuLightCuts.SetLightType(LightCuts::LightType::REAL);
+			// BLASes are built once, favor quality unless the builds are adaptive
+			LightCuts::BuildMode blasBuildMode = numBLASTriangles >= topDownBLASMinTriangles ? LightCuts::BuildMode::TOP_DOWN_SAOH : LightCuts::BuildMode::NN_CHAIN;
+			if ((int32_t)m_CPUBuildMode == LightTreeBuildSelector::numModes) blasBuildMode = BLASBuildSelector.Select(numBLASTriangles, m_CPUBLASBuildBudget);
+			cpuLightCuts.SetBuildMode(blasBuildMode);
+			triangleCones.resize(numBLASTriangles);
+			triangleCentroids.resize(numBLASTriangles);
+			trianglePowers.resize(numBLASTriangles);
+			triangleBounds.resize(numBLASTriangles);
 			aabb BLASbound;
 
 			for (int triId = 0; triId < numBLASTriangles; triId++)
@@ -145,29 +206,19 @@ void MeshLightTreeBuilder::Init(ComputeContext& cptContext, Model1* model, int n
 				BLASbound.Union(bbox);
 			}
 
-			int BLASOffset = BLASOffsets[meshId];
-			int numNodes = 2 * numBLASTriangles;
-
-			cpuLightCuts.Build(numBLASTriangles, [&](int i) {return trianglePowers[i]; },
-				[&](int i) {return triangleCentroids[i]; },
+			BLASBuildSelector.Measure(cpuLightCuts, numBLASTriangles, [&] {
+				cpuLightCuts.Build(numBLASTriangles, [&](int i) {return trianglePowers[i]; },
+					[&](int i) {return triangleCentroids[i]; },
 #ifdef LIGHT_CONE
-				[&](int i) {return triangleCones[i]; },
+					[&](int i) {return triangleCones[i]; },
 #else
-				[&](int i) {},
+					[&](int i) {},
 #endif
-				[&](int i) {return triangleBounds[i]; }, [&]() {return getUniform1D(state); });
+					[&](int i) {return triangleBounds[i]; }, meshId);
+			});
 
-			for (int i = 1; i < numNodes; i++)
-			{
-				LightCuts::Node curnode = cpuLightCuts.GetNode(i - 1);
-				BLAS[BLASOffset + i].boundMin = curnode.boundBox.pos;
-				BLAS[BLASOffset + i].boundMax = curnode.boundBox.end;
-				BLAS[BLASOffset + i].intensity = curnode.probTree;
-				BLAS[BLASOffset + i].ID = curnode.primaryChild >= numNodes ? numNodes + meshIndexOffset + 3 * (curnode.primaryChild - numNodes) : curnode.primaryChild;
-#ifdef LIGHT_CONE
-				BLAS[BLASOffset + i].cone = curnode.boundingCone;
-#endif
-			}
+			// the leaves point at the first index of their triangle
+			cpuLightCuts.ExportGPUNodes(&BLAS[BLASOffset], [&](int triId) { return numNodes + meshIndexOffset + 3 * triId; });
 
 			m_BLASBounds[meshId] = BLASbound;
 #ifdef LIGHT_CONE
@@ -178,6 +229,25 @@ void MeshLightTreeBuilder::Init(ComputeContext& cptContext, Model1* model, int n
 			// generate node levels by traversal
 			GenerateLevelIds(BLAS, CPUNodeBLASLevelBuffer, 1, BLASOffset, numNodes, 0);
 		}
+
+		if (useLightTreeCache && !BLASCacheHit)
+		{
+			// one header per BLAS, without an instance transform
+			std::vector<BLASInstanceHeader> BLASHeaders(numMeshLights);
+			for (int meshId = 0; meshId < numMeshLights; meshId++)
+			{
+				BLASHeaders[meshId].rotation = glm::mat3(1.0f);
+				BLASHeaders[meshId].scaling = 1.0f;
+				BLASHeaders[meshId].emission = meshLights[meshId].emission;
+				BLASHeaders[meshId].nodeOffset = BLASOffsets[meshId];
+				BLASHeaders[meshId].numTreeLevels = BLASTreeLevels[meshId];
+				BLASHeaders[meshId].numTreeLeafs = BLASTreeLeafs[meshId];
+				BLASHeaders[meshId].emitTexId = -1;
+				BLASHeaders[meshId].BLASId = meshId;
+			}
+			if (!WriteLightTreeFile(BLASCacheFile, nullptr, 0, 0.0f, BLAS.data(), numTotalBLASNodes, BLASHeaders.data(), numMeshLights, BLASCacheKey))
+				printf("Warning! cannot write the light tree cache %s\n", BLASCacheFile.c_str());
+		}
 #else
 
 		std::vector<Node> BLAS(numTotalBLASNodes);
@@ -401,6 +471,9 @@ void MeshLightTreeBuilder::Init(ComputeContext& cptContext, Model1* model, int n
 		m_BoundMaxBuffer.Create(L"SLC Bound Min Buffer", numTotalTriangleInstances, sizeof(Vector4));
 		m_BLASInstanceHeaders.Create(L"SLC BLAS Headers", numMeshLightInstances, sizeof(BLASInstanceHeader), CPUBLASInstanceHeaders.data());
 		HelpUtils::InitBboxReductionBuffers(numTotalTriangleInstances);
+#ifdef CPU_BUILDER
+		if (useLightTreeCache && numTotalTriangleInstances > m_CPUMaxLightsInMemory) PreprocessOneLevelTree(cptContext);
+#endif
 	}
 
 
@@ -439,6 +512,143 @@ void MeshLightTreeBuilder::Init(ComputeContext& cptContext, Model1* model, int n
 	isFirstTime = false;
 }
 
+#ifdef CPU_BUILDER
+uint64_t MeshLightTreeBuilder::LightTreeCacheKey(bool withInstances) const
+{
+	// everything the cached trees are built from: the builder, the node layout, the settings that choose how the tree is built
+	// and the emissive buffers of the model. Outside of Adaptive the BLAS build mode only depends on the triangle count.
+	bool adaptive = (int32_t)m_CPUBuildMode == LightTreeBuildSelector::numModes;
+	struct
+	{
+		int32_t builderVersion;
+		int32_t nodeSize;
+		int32_t buildMode;
+		float buildBudget;
+		int32_t maxLightsInMemory;
+		int32_t numMeshLights;
+		int32_t numMeshLightInstances;
+		int32_t withInstances;
+	} settings = { LIGHTCUTS_BUILDER_VERSION, (int32_t)sizeof(Node), 0, 0.0f, 0, numMeshLights, numMeshLightInstances, withInstances };
+	if (withInstances)
+	{
+		settings.buildMode = (int32_t)m_CPUBuildMode;
+		settings.buildBudget = adaptive ? (float)m_CPUBuildBudget : 0.0f;
+		settings.maxLightsInMemory = numTotalTriangleInstances > m_CPUMaxLightsInMemory ? (int32_t)m_CPUMaxLightsInMemory : 0;
+	}
+	else
+	{
+		settings.buildMode = adaptive ? 1 : 0;
+		settings.buildBudget = adaptive ? (float)m_CPUBLASBuildBudget : 0.0f;
+	}
+
+	size_t hash = Utility::HashState(&settings);
+	for (const CPUMeshLight& meshLight : m_Model->m_CPUMeshLights)
+	{
+		glm::ivec2 range(meshLight.indexOffset, meshLight.numTriangles);
+		hash = Utility::HashState(&range, 1, hash);
+	}
+	hash = Utility::HashState(m_Model->m_CPUMeshLightVertexBuffer.data(), m_Model->m_CPUMeshLightVertexBuffer.size(), hash);
+	hash = Utility::HashState(m_Model->m_CPUMeshLightIndexBuffer.data(), m_Model->m_CPUMeshLightIndexBuffer.size(), hash);
+	hash = Utility::HashState(m_Model->m_CPUEmissiveTriangleIntensityBuffer.data(), m_Model->m_CPUEmissiveTriangleIntensityBuffer.size(), hash);
+#ifdef LIGHT_CONE
+	hash = Utility::HashState(m_Model->m_CPUMeshLightPrecomputedBoundingCones.data(), m_Model->m_CPUMeshLightPrecomputedBoundingCones.size(), hash);
+#endif
+	if (withInstances)
+	{
+		hash = Utility::HashState(m_Model->m_CPUMeshlightIdForInstancesBuffer.data(), m_Model->m_CPUMeshlightIdForInstancesBuffer.size(), hash);
+		for (const BLASInstanceHeader& header : CPUBLASInstanceHeaders)
+		{
+			hash = Utility::HashState(&header.rotation, 1, hash);
+			hash = Utility::HashState(&header.translation, 1, hash);
+			hash = Utility::HashState(&header.scaling, 1, hash);
+		}
+	}
+	return hash;
+}
+
+void MeshLightTreeBuilder::GetTriangleLight(int meshInstId, int triId, glm::vec3& centroid, glm::vec4& cone, float& power, aabb& bound) const
+{
+	int meshId = m_Model->m_CPUMeshlightIdForInstancesBuffer[meshInstId];
+	int meshIndexOffset = m_Model->m_CPUMeshLights[meshId].indexOffset;
+
+	int v0 = m_Model->m_CPUMeshLightIndexBuffer[meshIndexOffset + 3 * triId];
+	int v1 = m_Model->m_CPUMeshLightIndexBuffer[meshIndexOffset + 3 * triId + 1];
+	int v2 = m_Model->m_CPUMeshLightIndexBuffer[meshIndexOffset + 3 * triId + 2];
+	glm::vec3 p0 = m_Model->m_CPUMeshLightVertexBuffer[v0].position;
+	glm::vec3 p1 = m_Model->m_CPUMeshLightVertexBuffer[v1].position;
+	glm::vec3 p2 = m_Model->m_CPUMeshLightVertexBuffer[v2].position;
+
+	const BLASInstanceHeader& header = CPUBLASInstanceHeaders[meshInstId];
+	p0 = header.rotation * header.scaling * p0 + header.translation;
+	p1 = header.rotation * header.scaling * p1 + header.translation;
+	p2 = header.rotation * header.scaling * p2 + header.translation;
+
+	centroid = (p0 + p1 + p2) / 3;
+
+	glm::vec4 meshCone = m_Model->m_CPUMeshLightPrecomputedBoundingCones[meshIndexOffset / 3 + triId];
+	cone = glm::vec4(header.rotation * glm::vec3(meshCone), meshCone.w);
+
+	power = header.scaling * m_Model->m_CPUEmissiveTriangleIntensityBuffer[meshIndexOffset / 3 + triId];
+
+	bound = aabb();
+	bound.Union(p0);
+	bound.Union(p1);
+	bound.Union(p2);
+}
+
+void MeshLightTreeBuilder::PreprocessOneLevelTree(ComputeContext& cptContext)
+{
+	std::string cacheFile = m_Model->m_FileName + ".tree.lct";
+	uint64_t cacheKey = LightTreeCacheKey(true);
+	{
+		MappedLightTree cache;
+		if (cache.Open(cacheFile) && cache.GetHeader().contentHash == cacheKey && cache.GetHeader().numNodes == 2 * numTotalTriangleInstances) return;
+	}
+
+	ScopedTimer _p0(L"Out-of-Core Light Tree Build", cptContext);
+
+	// the triangles are read from the model buffers one at a time, so that only the buckets of the builder are in memory
+	std::vector<int> instanceTriangleOffsets(numMeshLightInstances + 1, 0);
+	for (int i = 0; i < numMeshLightInstances; i++)
+	{
+		int meshId = m_Model->m_CPUMeshlightIdForInstancesBuffer[i];
+		instanceTriangleOffsets[i + 1] = instanceTriangleOffsets[i] + m_Model->m_CPUMeshLights[meshId].numTriangles;
+	}
+	auto triangleLight = [&](int i, glm::vec3& centroid, glm::vec4& cone, float& power, aabb& bound)
+	{
+		int meshInstId = int(std::upper_bound(instanceTriangleOffsets.begin(), instanceTriangleOffsets.end(), i) - instanceTriangleOffsets.begin()) - 1;
+		GetTriangleLight(meshInstId, i - instanceTriangleOffsets[meshInstId], centroid, cone, power, bound);
+	};
+	glm::vec3 centroid;
+	glm::vec4 cone;
+	float power;
+	aabb bound;
+
+	// build into a temporary file, so that a failed build does not leave a broken cache behind
+	std::string tempFile = cacheFile + ".tmp";
+	ExternalLightTreeBuilder externalLightTreeBuilder;
+	externalLightTreeBuilder.SetLightType(LightCuts::LightType::REAL);
+	externalLightTreeBuilder.SetBuildMode(buildSelector.Select(m_CPUBuildMode, numTotalTriangleInstances, m_CPUBuildBudget));
+	externalLightTreeBuilder.SetMaxLightsInMemory(m_CPUMaxLightsInMemory);
+	bool built = externalLightTreeBuilder.Build(numTotalTriangleInstances,
+		[&](int i) { triangleLight(i, centroid, cone, power, bound); return CPUColor(power); },
+		[&](int i) { triangleLight(i, centroid, cone, power, bound); return centroid; },
+#ifdef LIGHT_CONE
+		[&](int i) { triangleLight(i, centroid, cone, power, bound); return cone; },
+#else
+		[&](int i) {return glm::vec4(0, 0, 1, PI); },
+#endif
+		[&](int i) { triangleLight(i, centroid, cone, power, bound); return bound; }, 0, tempFile, cacheFile + ".spill", cacheKey);
+
+	std::remove(cacheFile.c_str());
+	if (!built || std::rename(tempFile.c_str(), cacheFile.c_str()) != 0)
+	{
+		std::remove(tempFile.c_str());
+		printf("Warning! the out-of-core light tree build failed, the tree is built in memory\n");
+	}
+}
+#endif
+
 void MeshLightTreeBuilder::Build(ComputeContext & cptContext, int frameId)
 {
 	if (!oneLevelTree)
@@ -446,10 +656,13 @@ void MeshLightTreeBuilder::Build(ComputeContext & cptContext, int frameId)
 #ifdef CPU_BUILDER
 		ScopedTimer _p0(L"Build light tree (CPU)", cptContext);
 
-		std::vector<aabb> newBLASBounds(numMeshLightInstances);
-		std::vector<float> newBLASIntensities(numMeshLightInstances); //todo: enable color animation?
+		std::vector<aabb>& newBLASBounds = instanceBounds;
+		std::vector<float>& newBLASIntensities = instanceIntensities; //todo: enable color animation?
+		newBLASBounds.resize(numMeshLightInstances);
+		newBLASIntensities.resize(numMeshLightInstances);
 #ifdef LIGHT_CONE
-		std::vector<glm::vec4> newBLASCones(numMeshLightInstances);
+		std::vector<glm::vec4>& newBLASCones = instanceCones;
+		newBLASCones.resize(numMeshLightInstances);
 #endif
 
 		concurrency::parallel_for(0, numMeshLightInstances, 1, [&](int meshInstanceId)
@@ -478,34 +691,35 @@ void MeshLightTreeBuilder::Build(ComputeContext & cptContext, int frameId)
 
 		int numNodes = 2 * numMeshLightInstances;
 
-		std::vector<int> CPUNodeTLASLevelBuffer(numNodes, -1);
+		std::vector<int>& CPUNodeTLASLevelBuffer = cpuNodeLevels;
+		CPUNodeTLASLevelBuffer.assign(numNodes, -1);
 
-		std::vector<Node> cpuNodes(numNodes);
+		cpuNodes.resize(numNodes);
 
-		state.seed(frameId);
-		cpuLightCuts.Build(numMeshLightInstances, [&](int i) {return CPUColor(newBLASIntensities[i],0,0); },
-			[&](int i) {return newBLASBounds[i].centroid(); },
+		auto instanceColorFunc = [&](int i) {return CPUColor(newBLASIntensities[i], 0, 0); };
 #ifdef LIGHT_CONE
-			[&](int i) {return newBLASCones[i]; },
+		auto instanceConeFunc = [&](int i) {return newBLASCones[i]; };
 #else
-			[&](int i) {},
+		auto instanceConeFunc = [&](int i) {};
 #endif
-			[&](int i) {return newBLASBounds[i]; },
-			[&]() {return getUniform1D(state); });
+		auto instanceBoundFunc = [&](int i) {return newBLASBounds[i]; };
+		auto instancePosFunc = [&](int i) {return newBLASBounds[i].centroid(); };
 
-		for (int i = 1; i < numNodes; i++)
+		// refit the TLAS of the previous frame, and rebuild it only when its quality has degraded too much
+		if (!cpuTLASLightCuts.Refit(numMeshLightInstances, instanceColorFunc, instancePosFunc, instanceConeFunc, instanceBoundFunc))
 		{
-			LightCuts::Node curnode = cpuLightCuts.GetNode(i - 1);
-			cpuNodes[i].boundMin = curnode.boundBox.pos;
-			cpuNodes[i].boundMax = curnode.boundBox.end;
-			cpuNodes[i].intensity = curnode.probTree;
-			cpuNodes[i].ID = curnode.primaryChild;
-#ifdef LIGHT_CONE
-			cpuNodes[i].cone = curnode.boundingCone;
-#endif
+			LightCuts::BuildMode buildMode = buildSelector.Select(m_CPUBuildMode, numMeshLightInstances, m_CPUBuildBudget);
+			cpuTLASLightCuts.SetBuildMode(buildMode);
+			ScopedTimer _p1(LightTreeBuildSelector::ModeName(buildMode), cptContext);
+			buildSelector.Measure(cpuTLASLightCuts, numMeshLightInstances, [&] {
+				cpuTLASLightCuts.Build(numMeshLightInstances, instanceColorFunc,
+					instancePosFunc, instanceConeFunc, instanceBoundFunc, frameId);
+			});
 		}
 
-		m_meshLightGlobalBounds.Update(4 * 7, 1, &cpuLightCuts.globalBoundDiag);
+		cpuTLASLightCuts.ExportGPUNodes(cpuNodes.data());
+
+		m_meshLightGlobalBounds.Update(4 * 7, 1, &cpuTLASLightCuts.globalBoundDiag);
 		m_TLAS.Update(0, numNodes, cpuNodes.data());
 
 		// generate node levels by traversal
@@ -534,82 +748,79 @@ void MeshLightTreeBuilder::Build(ComputeContext & cptContext, int frameId)
 
 		ScopedTimer _p0(L"Build light tree (CPU)", cptContext);
 
-		std::vector<glm::vec4> triangleCones(numTotalTriangleInstances);
-		std::vector<glm::vec3> triangleCentroids(numTotalTriangleInstances);
-		std::vector<CPUColor> trianglePowers(numTotalTriangleInstances);
-		std::vector<aabb> triangleBounds(numTotalTriangleInstances);
-
-		std::vector<CPUMeshLight>& meshLights = m_Model->m_CPUMeshLights;
-
-		int count = 0;
+		int numNodes = 2 * numTotalTriangleInstances;
+		cpuNodes.resize(numNodes);
+		std::vector<int>& CPUNodeBLASLevelBuffer = cpuNodeLevels;
+		CPUNodeBLASLevelBuffer.assign(numNodes, -1);
+
+		// only the tree of the scene as loaded is cached, not the rebuilds after instance updates
+		std::string cacheFile = m_Model->m_FileName + ".tree.lct";
+		uint64_t cacheKey = useLightTreeCache ? LightTreeCacheKey(true) : 0;
+		float globalBoundDiag = 0;
+		bool cacheHit = false;
+		if (useLightTreeCache)
+		{
+			MappedLightTree cache;
+			if (cache.Open(cacheFile) && cache.GetHeader().contentHash == cacheKey && cache.GetHeader().numNodes == numNodes &&
+				cache.GetHeader().numBLASHeaders == 0)
+			{
+				memcpy(cpuNodes.data(), cache.GetNodes(), numNodes * sizeof(Node));
+				globalBoundDiag = cache.GetHeader().globalBoundDiag;
+				cacheHit = true;
+			}
+		}
 
-		for (int meshInstId = 0; meshInstId < numMeshLightInstances; meshInstId++)
+		if (!cacheHit)
 		{
-			int meshId = m_Model->m_CPUMeshlightIdForInstancesBuffer[meshInstId];
+			triangleCones.resize(numTotalTriangleInstances);
+			triangleCentroids.resize(numTotalTriangleInstances);
+			trianglePowers.resize(numTotalTriangleInstances);
+			triangleBounds.resize(numTotalTriangleInstances);
 
-			int numBLASTriangles = meshLights[meshId].numTriangles;
-			int meshIndexOffset = meshLights[meshId].indexOffset;
+			std::vector<CPUMeshLight>& meshLights = m_Model->m_CPUMeshLights;
 
-			aabb BLASbound;
+			int count = 0;
 
-			for (int triId = 0; triId < numBLASTriangles; triId++, count++)
+			for (int meshInstId = 0; meshInstId < numMeshLightInstances; meshInstId++)
 			{
-				int v0 = m_Model->m_CPUMeshLightIndexBuffer[meshIndexOffset + 3 * triId];
-				int v1 = m_Model->m_CPUMeshLightIndexBuffer[meshIndexOffset + 3 * triId + 1];
-				int v2 = m_Model->m_CPUMeshLightIndexBuffer[meshIndexOffset + 3 * triId + 2];
-				glm::vec3 p0 = m_Model->m_CPUMeshLightVertexBuffer[v0].position;
-				glm::vec3 p1 = m_Model->m_CPUMeshLightVertexBuffer[v1].position;
-				glm::vec3 p2 = m_Model->m_CPUMeshLightVertexBuffer[v2].position;
-
-				BLASInstanceHeader& header = CPUBLASInstanceHeaders[meshInstId];
-				p0 = header.rotation * header.scaling * p0 + header.translation;
-				p1 = header.rotation * header.scaling * p1 + header.translation;
-				p2 = header.rotation * header.scaling * p2 + header.translation;
+				int meshId = m_Model->m_CPUMeshlightIdForInstancesBuffer[meshInstId];
 
-				triangleCentroids[count] = (p0 + p1 + p2) / 3;
+				int numBLASTriangles = meshLights[meshId].numTriangles;
 
-				glm::vec4 cone = m_Model->m_CPUMeshLightPrecomputedBoundingCones[meshIndexOffset / 3 + triId];
-				triangleCones[count] = glm::vec4(header.rotation * glm::vec3(cone), cone.w);
-
-				trianglePowers[count] = header.scaling *  m_Model->m_CPUEmissiveTriangleIntensityBuffer[meshIndexOffset / 3 + triId];
-
-				aabb bbox;
-				bbox.Union(p0);
-				bbox.Union(p1);
-				bbox.Union(p2);
-				triangleBounds[count] = bbox;
-				BLASbound.Union(bbox);
+				for (int triId = 0; triId < numBLASTriangles; triId++, count++)
+				{
+					float power;
+					GetTriangleLight(meshInstId, triId, triangleCentroids[count], triangleCones[count], power, triangleBounds[count]);
+					trianglePowers[count] = power;
+				}
 			}
-		}
-
-		int numNodes = 2 * numTotalTriangleInstances;
-		std::vector<Node> cpuNodes(numNodes);
-		std::vector<int> CPUNodeBLASLevelBuffer(numNodes, -1);
-
-		state.seed(frameId);
 
-		cpuLightCuts.SetLightType(LightCuts::LightType::REAL);
-		cpuLightCuts.Build(numTotalTriangleInstances, [&](int i) {return trianglePowers[i]; },
-			[&](int i) {return triangleCentroids[i]; },
+			cpuLightCuts.SetLightType(LightCuts::LightType::REAL);
+			LightCuts::BuildMode buildMode = buildSelector.Select(m_CPUBuildMode, numTotalTriangleInstances, m_CPUBuildBudget);
+			cpuLightCuts.SetBuildMode(buildMode);
+			{
+				ScopedTimer _p1(LightTreeBuildSelector::ModeName(buildMode), cptContext);
+				buildSelector.Measure(cpuLightCuts, numTotalTriangleInstances, [&] {
+					cpuLightCuts.Build(numTotalTriangleInstances, [&](int i) {return trianglePowers[i]; },
+						[&](int i) {return triangleCentroids[i]; },
 #ifdef LIGHT_CONE
-			[&](int i) {return triangleCones[i]; },
+						[&](int i) {return triangleCones[i]; },
 #else
-			[&](int i) {},
+						[&](int i) {},
 #endif
-			[&](int i) {return triangleBounds[i]; }, [&]() {return getUniform1D(state); });
+						[&](int i) {return triangleBounds[i]; }, frameId);
+				});
+			}
 
-		for (int i = 1; i < numNodes; i++)
-		{
-			LightCuts::Node curnode = cpuLightCuts.GetNode(i - 1);
-			cpuNodes[i].boundMin = curnode.boundBox.pos;
-			cpuNodes[i].boundMax = curnode.boundBox.end;
-			cpuNodes[i].intensity = curnode.probTree;
-			cpuNodes[i].ID = curnode.primaryChild >= numNodes ? numNodes + (curnode.primaryChild - numNodes) : curnode.primaryChild;
-#ifdef LIGHT_CONE
-			cpuNodes[i].cone = curnode.boundingCone;
-#endif
+			cpuLightCuts.ExportGPUNodes(cpuNodes.data());
+			globalBoundDiag = cpuLightCuts.globalBoundDiag;
+
+			if (useLightTreeCache && !WriteLightTreeFile(cacheFile, cpuNodes.data(), numNodes, globalBoundDiag, nullptr, 0, nullptr, 0, cacheKey))
+				printf("Warning! cannot write the light tree cache %s\n", cacheFile.c_str());
 		}
-		m_meshLightGlobalBounds.Update(4 * 7, 1, &cpuLightCuts.globalBoundDiag);
+		useLightTreeCache = false;
+
+		m_meshLightGlobalBounds.Update(4 * 7, 1, &globalBoundDiag);
 
 		m_BLAS.Update(0, numNodes, cpuNodes.data());
 
@@ -31,6 +31,8 @@
 #include "HelpUtils.h"
 #ifdef CPU_BUILDER
 #include "CPULightCuts.h"
+#include "CPUBuildSelector.h"
+#include "CPUExternalLightTreeBuilder.h"
 #endif
 class MeshLightTreeBuilder
 {
@@ -63,6 +65,17 @@ private:
 	void SortASLeafs(ComputeContext& cptContext, int numLights, int leafStartIndex, int quantLevels,
 		StructuredBuffer& leafBuffer, StructuredBuffer& nodeBuffer, int isBLAS);
 
+#ifdef CPU_BUILDER
+	// the content hash of the light tree cache files, with the instances for the one-level tree
+	uint64_t LightTreeCacheKey(bool withInstances) const;
+
+	// the centroid, cone, power and bounds of triangle triId of mesh light instance meshInstId in world space
+	void GetTriangleLight(int meshInstId, int triId, glm::vec3& centroid, glm::vec4& cone, float& power, aabb& bound) const;
+
+	// builds the cached one-level tree out of core, streaming the triangles from the model, unless the cache already holds it
+	void PreprocessOneLevelTree(ComputeContext& cptContext);
+#endif
+
 public:
 
 	int GetTLASLeafStartIndex() 
@@ -148,6 +161,21 @@ private:
 
 #ifdef CPU_BUILDER
 	LightCuts cpuLightCuts;
-	std::default_random_engine state;
+	LightCuts cpuTLASLightCuts; // kept across frames, so that the TLAS of animated instances can be refitted
+	LightCuts::BuildWorkspace buildWorkspace; // shared by both trees, sized once by the BLAS builds in Init
+	LightTreeBuildSelector buildSelector; // for the trees built every frame
+	LightTreeBuildSelector BLASBuildSelector;
+	bool useLightTreeCache = false; // set by Init, cleared by the first Build, which is the only one of a one-level tree that is cached
+
+	// the arrays of the per-frame builds, kept across frames so that the rebuilds do not allocate
+	std::vector<aabb> instanceBounds;
+	std::vector<float> instanceIntensities;
+	std::vector<glm::vec4> instanceCones;
+	std::vector<glm::vec4> triangleCones;
+	std::vector<glm::vec3> triangleCentroids;
+	std::vector<CPUColor> trianglePowers;
+	std::vector<aabb> triangleBounds;
+	std::vector<Node> cpuNodes;
+	std::vector<int> cpuNodeLevels;
 #endif
 };
\ No newline at end of file
@@ -241,6 +241,8 @@ public:
 	};
 	Material *m_pMaterial;
 
+	std::string m_FileName; // the first file of Load, next to which the light tree caches are kept
+
 	std::vector<CPUMeshLight> m_CPUMeshLights;
 	std::vector<int> m_CPUMeshLightInstancesBuffer; // this just extracts corresponding instances from the mesh instance list
 
@@ -306,6 +308,7 @@ public:
 
 	virtual bool Load(const std::vector<std::string>& filenames)
 	{
+		m_FileName = filenames[0];
 		if (filenames[0].substr(filenames[0].find_last_of(".")) == ".h3d")
 		{
 			return LoadDemoScene(filenames[0].c_str());
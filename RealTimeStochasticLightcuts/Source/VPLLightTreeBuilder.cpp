@@ -28,6 +28,10 @@
 #include <aclapi.h>
 
 extern BoolVar m_EnableNodeViz;
+#ifdef CPU_BUILDER
+extern EnumVar m_CPUBuildMode;
+extern NumVar m_CPUBuildBudget;
+#endif
 
 void VPLLightTreeBuilder::Init(ComputeContext& cptContext, int _numVPLs, std::vector<StructuredBuffer>& _VPLs, int _quantizationLevels)
 {
@@ -60,6 +64,9 @@ void VPLLightTreeBuilder::Init(ComputeContext& cptContext, int _numVPLs, std::ve
 	m_BLASViz.Create(L"SLC Viz Nodes", numStorageNodes, sizeof(VizNode));
 #ifdef CPU_BUILDER
 	m_BLASNodeLevel.Create(L"SLC CPU BUILDER Node Level", numStorageNodes, sizeof(int));
+	VPLReadbacks[POSITION].Create(L"VPL Position Readback", numVPLs, sizeof(Vector3));
+	VPLReadbacks[NORMAL].Create(L"VPL Normal Readback", numVPLs, sizeof(Vector3));
+	VPLReadbacks[COLOR].Create(L"VPL Color Readback", numVPLs, sizeof(Vector3));
 #endif
 	HelpUtils::InitBboxReductionBuffers(numTreeLights);
 
@@ -89,46 +96,54 @@ void VPLLightTreeBuilder::Build(ComputeContext & cptContext, bool sortLights, in
 {
 #ifdef CPU_BUILDER
 	ScopedTimer _p0(L"Build light tree (CPU)", cptContext);
-	std::vector<Vector3> lightPositions = TestUtils::ReadBackCPUVector<Vector3>(cptContext, VPLs[POSITION], numVPLs);
-	std::vector<Vector3> lightColors = TestUtils::ReadBackCPUVector<Vector3>(cptContext, VPLs[COLOR], numVPLs);
+
+	// build straight from the mapped readbacks of the VPL buffers (float4 per VPL)
 #ifdef LIGHT_CONE
-	std::vector<Vector3> lightNormals = TestUtils::ReadBackCPUVector<Vector3>(cptContext, VPLs[NORMAL], numVPLs);
+	const int numAttributes = 3;
+#else
+	const int numAttributes = 2; // the normals are only needed for the cones
 #endif
+	const VPLAttributes attributes[3] = { POSITION, COLOR, NORMAL };
+	for (int a = 0; a < numAttributes; a++)
+	{
+		cptContext.TransitionResource(VPLs[attributes[a]], D3D12_RESOURCE_STATE_COPY_SOURCE);
+		cptContext.TransitionResource(VPLReadbacks[attributes[a]], D3D12_RESOURCE_STATE_COPY_DEST);
+		cptContext.CopyBufferRegion(VPLReadbacks[attributes[a]], 0, VPLs[attributes[a]], 0, numVPLs * sizeof(Vector3));
+	}
+	cptContext.Flush(true);
 
-	cpuLightCuts.SetLightType(LightCuts::LightType::POINT);
+	LightCuts::LightViews views;
+	views.positions = LightCuts::AttributeView(VPLReadbacks[POSITION].Map(), sizeof(Vector3));
+	views.colors = LightCuts::AttributeView(VPLReadbacks[COLOR].Map(), sizeof(Vector3));
+#ifdef LIGHT_CONE
+	views.coneAxes = LightCuts::AttributeView(VPLReadbacks[NORMAL].Map(), sizeof(Vector3));
+#endif
 
-	state.seed(frameId + 2); 	// use this for sponza default
+	cpuLightCuts.SetLightType(LightCuts::LightType::POINT);
+	LightCuts::BuildMode buildMode = buildSelector.Select(m_CPUBuildMode, numVPLs, m_CPUBuildBudget);
+	cpuLightCuts.SetBuildMode(buildMode);
+	{
+		ScopedTimer _p1(LightTreeBuildSelector::ModeName(buildMode), cptContext);
+		buildSelector.Measure(cpuLightCuts, numVPLs, [&] { cpuLightCuts.Build(numVPLs, views, frameId + 2); });	// use this seed for sponza default
+	}
 
-	cpuLightCuts.Build(numVPLs, [&](int i) {return CPUColor(lightColors[i].GetX(), lightColors[i].GetY(), lightColors[i].GetZ()); },
-		[&](int i) {return glm::vec3(lightPositions[i].GetX(), lightPositions[i].GetY(), lightPositions[i].GetZ()); },
+	VPLReadbacks[POSITION].Unmap();
+	VPLReadbacks[COLOR].Unmap();
 #ifdef LIGHT_CONE
-		[&](int i) {return glm::vec4(lightNormals[i].GetX(), lightNormals[i].GetY(), lightNormals[i].GetZ(), 0); },
-#else
-		[&](int i) {},
+	VPLReadbacks[NORMAL].Unmap();
 #endif
-		[&](int i) {return aabb(lightPositions[i]); }, [&]() {return getUniform1D(state); });
 
 	int numNodes = 2 * numVPLs;
 
-	std::vector<Node> cpuNodes(numNodes);
-	for (int i = 1; i < numNodes; i++)
-	{
-		LightCuts::Node curnode = cpuLightCuts.GetNode(i - 1);
-		cpuNodes[i].boundMin = curnode.boundBox.pos;
-		cpuNodes[i].boundMax = curnode.boundBox.end;
-		cpuNodes[i].intensity = curnode.probTree;
-		cpuNodes[i].ID = curnode.primaryChild;
-#ifdef LIGHT_CONE
-		cpuNodes[i].cone = curnode.boundingCone;
-#endif
-	}
+	cpuNodes.resize(numNodes);
+	cpuLightCuts.ExportGPUNodes(cpuNodes.data());
 
 	nodes.Update(0, numNodes, cpuNodes.data());
 	cptContext.Flush(true);
 
-	std::vector<int> CPUNodeBLASLevelBuffer(numNodes, -1);
-	GenerateLevelIds(cpuNodes, CPUNodeBLASLevelBuffer, 1, 0, numNodes, 0);
-	m_BLASNodeLevel.Update(0, numNodes, CPUNodeBLASLevelBuffer.data());
+	cpuNodeLevels.assign(numNodes, -1);
+	GenerateLevelIds(cpuNodes, cpuNodeLevels, 1, 0, numNodes, 0);
+	m_BLASNodeLevel.Update(0, numNodes, cpuNodeLevels.data());
 #else
 	ScopedTimer _p0(L"Build light tree", cptContext);
 
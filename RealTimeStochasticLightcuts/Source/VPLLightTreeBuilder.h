@@ -27,6 +27,7 @@
 #include "LightTreeMacros.h"
 #ifdef CPU_BUILDER
 #include "CPULightCuts.h"
+#include "CPUBuildSelector.h"
 #endif
 
 #ifdef CUDA_SORT
@@ -120,7 +121,11 @@ public:
 	float globalIntensity;
 
 #ifdef CPU_BUILDER
+	ReadbackBuffer VPLReadbacks[3]; // mapped by the CPU build, indexed by VPLAttributes
 	LightCuts cpuLightCuts;
-	std::default_random_engine state;
+	LightTreeBuildSelector buildSelector;
+	// kept across frames so that the rebuilds do not allocate
+	std::vector<Node> cpuNodes;
+	std::vector<int> cpuNodeLevels;
 #endif
 };
\ No newline at end of file